@@ -0,0 +1,211 @@
+#include "common/clcache.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cinttypes>
+#include <cstdio>
+#include <ctime>
+#include <regex>
+#include <set>
+#include <sstream>
+#include <vector>
+
+#include "common/swaglog.h"
+#include "common/util.h"
+
+namespace {
+
+// binaries unused for longer than this are dropped, then the least recently used ones above the size limit
+const int CACHE_AGE_MAX = 30 * 24 * 60 * 60;
+const off_t CACHE_SIZE_MAX = 64 * 1024 * 1024;
+
+std::string get_device_info(cl_device_id device_id, cl_device_info param_name) {
+  size_t size = 0;
+  CL_CHECK(clGetDeviceInfo(device_id, param_name, 0, NULL, &size));
+  std::string info(size, '\0');
+  CL_CHECK(clGetDeviceInfo(device_id, param_name, size, info.data(), NULL));
+  return info;
+}
+
+// 64-bit FNV-1a, stable across builds unlike std::hash
+uint64_t fnv1a(const std::string& s, uint64_t h = 0xcbf29ce484222325ULL) {
+  for (unsigned char c : s) {
+    h = (h ^ c) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+std::string cache_dir() {
+  return util::getenv("CL_CACHE_DIR", util::file_exists("/data") ? "/data/cl_cache" : "/tmp/cl_cache");
+}
+
+std::string dirname(const std::string& path) {
+  const size_t pos = path.find_last_of('/');
+  return pos == std::string::npos ? "." : path.substr(0, pos);
+}
+
+// -I directories from the build options
+std::vector<std::string> include_dirs(const char* args) {
+  std::vector<std::string> dirs;
+  std::istringstream ss(args ? args : "");
+  std::string tok;
+  while (ss >> tok) {
+    if (tok == "-I") {
+      if (ss >> tok) dirs.push_back(tok);
+    } else if (tok.rfind("-I", 0) == 0) {
+      dirs.push_back(tok.substr(2));
+    }
+  }
+  return dirs;
+}
+
+// hash every file pulled in with #include, resolved like the compiler does from the
+// including file's directory and the -I directories, so editing a header invalidates the cache
+uint64_t hash_includes(const std::string& src, const std::string& dir, const std::vector<std::string>& dirs,
+                       std::set<std::string>& seen, uint64_t h) {
+  static const std::regex include_re(R"(^\s*#\s*include\s*["<]([^">]+)[">])");
+  std::istringstream lines(src);
+  std::string line;
+  std::smatch m;
+  while (std::getline(lines, line)) {
+    if (!std::regex_search(line, m, include_re)) continue;
+
+    const std::string name = m[1];
+    std::vector<std::string> search = dirs;
+    if (!dir.empty()) search.insert(search.begin(), dir);
+    for (const std::string& d : search) {
+      const std::string path = d + "/" + name;
+      if (!util::file_exists(path)) continue;
+      if (seen.insert(path).second) {
+        const std::string inc = util::read_file(path);
+        h = fnv1a(inc, fnv1a(name, h));
+        h = hash_includes(inc, dirname(path), dirs, seen, h);
+      }
+      break;
+    }
+  }
+  return h;
+}
+
+// dir is where quoted includes of src are looked up first, empty for sources not read from a file
+std::string cache_path(cl_device_id device_id, const std::string& src, const char* args, const std::string& dir) {
+  uint64_t h = fnv1a(src);
+  h = fnv1a(args ? args : "", h);
+  std::set<std::string> seen;
+  h = hash_includes(src, dir, include_dirs(args), seen, h);
+  for (cl_device_info info : {CL_DEVICE_NAME, CL_DEVICE_VERSION, CL_DRIVER_VERSION}) {
+    h = fnv1a(get_device_info(device_id, info), h);
+  }
+  char fn[32];
+  snprintf(fn, sizeof(fn), "%016" PRIx64 ".bin", h);
+  return cache_dir() + "/" + fn;
+}
+
+void prune_cache() {
+  const std::string dir = cache_dir();
+  DIR* d = opendir(dir.c_str());
+  if (!d) return;
+
+  struct Entry {
+    std::string path;
+    time_t mtime;
+    off_t size;
+  };
+  std::vector<Entry> entries;
+  off_t total = 0;
+  const time_t now = time(NULL);
+  while (struct dirent* de = readdir(d)) {
+    const std::string path = dir + "/" + de->d_name;
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+    if (now - st.st_mtime > CACHE_AGE_MAX) {
+      unlink(path.c_str());
+      continue;
+    }
+    entries.push_back({path, st.st_mtime, st.st_size});
+    total += st.st_size;
+  }
+  closedir(d);
+
+  std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.mtime < b.mtime; });
+  for (const Entry& e : entries) {
+    if (total <= CACHE_SIZE_MAX) break;
+    unlink(e.path.c_str());
+    total -= e.size;
+  }
+}
+
+cl_program program_from_binary(cl_context ctx, cl_device_id device_id, const std::string& binary, const char* args) {
+  const unsigned char* bin = (const unsigned char*)binary.data();
+  const size_t length = binary.size();
+  cl_int binary_status = CL_INVALID_BINARY, err = CL_INVALID_VALUE;
+  cl_program prg = clCreateProgramWithBinary(ctx, 1, &device_id, &length, &bin, &binary_status, &err);
+  if (err != CL_SUCCESS || binary_status != CL_SUCCESS) {
+    if (prg) clReleaseProgram(prg);
+    return nullptr;
+  }
+  if (clBuildProgram(prg, 1, &device_id, args, NULL, NULL) != CL_SUCCESS) {
+    clReleaseProgram(prg);
+    return nullptr;
+  }
+  return prg;
+}
+
+void save_binary(cl_program prg, const std::string& path) {
+  size_t size = 0;
+  CL_CHECK(clGetProgramInfo(prg, CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, NULL));
+  if (size == 0) return;
+
+  std::vector<unsigned char> binary(size);
+  unsigned char* ptr = binary.data();
+  CL_CHECK(clGetProgramInfo(prg, CL_PROGRAM_BINARIES, sizeof(ptr), &ptr, NULL));
+
+  // write to a temp file and rename, so concurrent readers never see a partial binary
+  const std::string tmp_path = path + ".tmp" + std::to_string(getpid());
+  if (!util::create_directories(cache_dir(), 0775) ||
+      util::write_file(tmp_path.c_str(), binary.data(), binary.size(), O_WRONLY | O_CREAT | O_TRUNC) != 0 ||
+      rename(tmp_path.c_str(), path.c_str()) != 0) {
+    LOGW("failed to write OpenCL program cache %s", path.c_str());
+    unlink(tmp_path.c_str());
+  }
+  prune_cache();
+}
+
+cl_program cached_program_from_source(cl_context ctx, cl_device_id device_id, const std::string& src, const char* args,
+                                      const std::string& dir) {
+  const std::string path = cache_path(device_id, src, args, dir);
+
+  const std::string binary = util::read_file(path);
+  if (!binary.empty()) {
+    cl_program prg = program_from_binary(ctx, device_id, binary, args);
+    if (prg) {
+      // mark as recently used for prune_cache
+      utime(path.c_str(), NULL);
+      return prg;
+    }
+    LOGW("discarding invalid OpenCL program cache %s", path.c_str());
+    unlink(path.c_str());
+  }
+
+  cl_program prg = cl_program_from_source(ctx, device_id, src, args);
+  save_binary(prg, path);
+  return prg;
+}
+
+}  // namespace
+
+cl_program cl_cached_program_from_source(cl_context ctx, cl_device_id device_id, const std::string& src, const char* args) {
+  return cached_program_from_source(ctx, device_id, src, args, "");
+}
+
+cl_program cl_cached_program_from_file(cl_context ctx, cl_device_id device_id, const char* path, const char* args) {
+  std::string src = util::read_file(path);
+  assert(src.length() > 0);
+  return cached_program_from_source(ctx, device_id, src, args, dirname(path));
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <string>
+
+#include "common/clutil.h"
+
+// Same as cl_program_from_file/cl_program_from_source, but the built program
+// binary is kept on disk, keyed on (source and every file it #includes, build
+// options, device, driver). Later processes load the binary instead of compiling
+// the source again. The cache lives in $CL_CACHE_DIR (default /data/cl_cache, or
+// /tmp/cl_cache off device) and is trimmed by age and total size on every write.
+cl_program cl_cached_program_from_source(cl_context ctx, cl_device_id device_id, const std::string& src, const char* args = nullptr);
+cl_program cl_cached_program_from_file(cl_context ctx, cl_device_id device_id, const char* path, const char* args);
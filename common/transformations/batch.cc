@@ -0,0 +1,159 @@
+#define _USE_MATH_DEFINES
+
+#include <algorithm>
+#include <cmath>
+
+#include "batch.hpp"
+
+namespace {
+
+// Points are converted BLOCK at a time, split into one array per coordinate so the
+// loops over a block have a fixed trip count and the compiler vectorizes everything
+// but the calls to the trigonometric functions.
+constexpr int BLOCK = 8;
+
+// WGS84, same as coordinates.cc
+constexpr double WGS84_A = 6378137.0;
+constexpr double WGS84_B = 6356752.31424518;
+constexpr double WGS84_ESQ = 6.69437999014 * 0.001;
+constexpr double WGS84_E1SQ = 6.73949674228 * 0.001;
+
+constexpr double DEG_TO_RAD = M_PI / 180.0;
+
+// Bowring's iteration converges to double precision in two steps for anything
+// from 1000 km below the surface up to beyond gps orbit altitudes
+constexpr int ECEF2GEODETIC_ITERATIONS = 2;
+
+typedef double Block[BLOCK];
+
+// Calls kernel(in, out) for every block of points, a short last block is padded with
+// copies of its last point
+template <int IN_DIM, int OUT_DIM, typename Kernel>
+void for_each_block(const double *in, double *out, int n, const Kernel &kernel) {
+  Block block_in[IN_DIM], block_out[OUT_DIM];
+  for (int i0 = 0; i0 < n; i0 += BLOCK) {
+    int m = std::min(BLOCK, n - i0);
+    for (int k = 0; k < BLOCK; k++) {
+      const double *p = in + (i0 + std::min(k, m - 1)) * IN_DIM;
+      for (int c = 0; c < IN_DIM; c++) block_in[c][k] = p[c];
+    }
+    kernel(block_in, block_out);
+    for (int k = 0; k < m; k++) {
+      double *p = out + (i0 + k) * OUT_DIM;
+      for (int c = 0; c < OUT_DIM; c++) p[c] = block_out[c][k];
+    }
+  }
+}
+
+void affine_batch(const Eigen::Matrix3d &M, const Eigen::Vector3d &pre, const Eigen::Vector3d &post, const double *in, double *out, int n) {
+  for_each_block<3, 3>(in, out, n, [&](const Block *v, Block *r) {
+    Block d[3];
+    for (int c = 0; c < 3; c++) {
+      for (int k = 0; k < BLOCK; k++) d[c][k] = v[c][k] - pre(c);
+    }
+    for (int c = 0; c < 3; c++) {
+      for (int k = 0; k < BLOCK; k++) r[c][k] = M(c, 0) * d[0][k] + M(c, 1) * d[1][k] + M(c, 2) * d[2][k] + post(c);
+    }
+  });
+}
+
+}  // namespace
+
+void geodetic2ecef_batch(const double *geodetic, double *ecef, int n) {
+  for_each_block<3, 3>(geodetic, ecef, n, [](const Block *g, Block *e) {
+    Block slat, clat, slon, clon;
+    for (int k = 0; k < BLOCK; k++) {
+      slat[k] = sin(g[0][k] * DEG_TO_RAD);
+      clat[k] = cos(g[0][k] * DEG_TO_RAD);
+      slon[k] = sin(g[1][k] * DEG_TO_RAD);
+      clon[k] = cos(g[1][k] * DEG_TO_RAD);
+    }
+    for (int k = 0; k < BLOCK; k++) {
+      double xi = sqrt(1 - WGS84_ESQ * slat[k] * slat[k]);
+      e[0][k] = (WGS84_A / xi + g[2][k]) * clat[k] * clon[k];
+      e[1][k] = (WGS84_A / xi + g[2][k]) * clat[k] * slon[k];
+      e[2][k] = (WGS84_A / xi * (1 - WGS84_ESQ) + g[2][k]) * slat[k];
+    }
+  });
+}
+
+void ecef2geodetic_batch(const double *ecef, double *geodetic, int n) {
+  // Bowring's method, iterating on the reduced latitude beta with tan(beta) = s / c.
+  // Only the final latitude and the longitude need an atan2, the iteration is plain
+  // arithmetic and a sqrt per step.
+  for_each_block<3, 3>(ecef, geodetic, n, [](const Block *e, Block *g) {
+    Block p, s, c, num, den;
+    for (int k = 0; k < BLOCK; k++) {
+      p[k] = sqrt(e[0][k] * e[0][k] + e[1][k] * e[1][k]);
+      s[k] = WGS84_A * e[2][k];
+      c[k] = WGS84_B * p[k];
+    }
+    for (int i = 0; i < ECEF2GEODETIC_ITERATIONS; i++) {
+      for (int k = 0; k < BLOCK; k++) {
+        double r = sqrt(s[k] * s[k] + c[k] * c[k]);
+        double sb = s[k] / r, cb = c[k] / r;
+        // tan(lat) = num / den, tan(beta) = b / a * tan(lat)
+        num[k] = e[2][k] + WGS84_E1SQ * WGS84_B * sb * sb * sb;
+        den[k] = p[k] - WGS84_ESQ * WGS84_A * cb * cb * cb;
+        s[k] = WGS84_B * num[k];
+        c[k] = WGS84_A * den[k];
+      }
+    }
+    for (int k = 0; k < BLOCK; k++) {
+      g[0][k] = atan2(num[k], den[k]) / DEG_TO_RAD;
+      g[1][k] = atan2(e[1][k], e[0][k]) / DEG_TO_RAD;
+    }
+    for (int k = 0; k < BLOCK; k++) {
+      double h = sqrt(num[k] * num[k] + den[k] * den[k]);
+      double slat = num[k] / h, clat = den[k] / h;
+      g[2][k] = p[k] * clat + e[2][k] * slat - WGS84_A * sqrt(1 - WGS84_ESQ * slat * slat);
+    }
+  });
+}
+
+void ecef2ned_batch(const Eigen::Matrix3d &ecef2ned_matrix, const Eigen::Vector3d &init_ecef, const double *ecef, double *ned, int n) {
+  affine_batch(ecef2ned_matrix, init_ecef, Eigen::Vector3d::Zero(), ecef, ned, n);
+}
+
+void ned2ecef_batch(const Eigen::Matrix3d &ned2ecef_matrix, const Eigen::Vector3d &init_ecef, const double *ned, double *ecef, int n) {
+  affine_batch(ned2ecef_matrix, Eigen::Vector3d::Zero(), init_ecef, ned, ecef, n);
+}
+
+void euler2quat_batch(const double *euler, double *quat, int n) {
+  // yaw * pitch * roll like euler2quat, with w >= 0 like ensure_unique
+  for_each_block<3, 4>(euler, quat, n, [](const Block *e, Block *q) {
+    Block sr, cr, sp, cp, sy, cy;
+    for (int k = 0; k < BLOCK; k++) {
+      sr[k] = sin(e[0][k] / 2); cr[k] = cos(e[0][k] / 2);
+      sp[k] = sin(e[1][k] / 2); cp[k] = cos(e[1][k] / 2);
+      sy[k] = sin(e[2][k] / 2); cy[k] = cos(e[2][k] / 2);
+    }
+    for (int k = 0; k < BLOCK; k++) {
+      double w = cr[k] * cp[k] * cy[k] + sr[k] * sp[k] * sy[k];
+      double sign = w > 0 ? 1.0 : -1.0;
+      q[0][k] = sign * w;
+      q[1][k] = sign * (sr[k] * cp[k] * cy[k] - cr[k] * sp[k] * sy[k]);
+      q[2][k] = sign * (cr[k] * sp[k] * cy[k] + sr[k] * cp[k] * sy[k]);
+      q[3][k] = sign * (cr[k] * cp[k] * sy[k] - sr[k] * sp[k] * cy[k]);
+    }
+  });
+}
+
+void quat2euler_batch(const double *quat, double *euler, int n) {
+  for_each_block<4, 3>(quat, euler, n, [](const Block *q, Block *e) {
+    Block roll_y, roll_x, pitch_s, yaw_y, yaw_x;
+    for (int k = 0; k < BLOCK; k++) {
+      double w = q[0][k], x = q[1][k], y = q[2][k], z = q[3][k];
+      roll_y[k] = 2 * (w * x + y * z);
+      roll_x[k] = 1 - 2 * (x * x + y * y);
+      pitch_s[k] = std::clamp(2 * (w * y - z * x), -1.0, 1.0);
+      yaw_y[k] = 2 * (w * z + x * y);
+      yaw_x[k] = 1 - 2 * (y * y + z * z);
+    }
+    for (int k = 0; k < BLOCK; k++) {
+      e[0][k] = atan2(roll_y[k], roll_x[k]);
+      e[1][k] = asin(pitch_s[k]);
+      e[2][k] = atan2(yaw_y[k], yaw_x[k]);
+    }
+  });
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <eigen3/Eigen/Dense>
+
+// Batch versions of the conversions in coordinates.hpp and orientation.hpp. Points
+// are n rows of a contiguous row major array ([n, 3], quaternions [n, 4] as w, x, y, z),
+// geodetic coordinates are in degrees. in and out may be the same array.
+
+void geodetic2ecef_batch(const double *geodetic, double *ecef, int n);
+void ecef2geodetic_batch(const double *ecef, double *geodetic, int n);
+
+// ned = ecef2ned_matrix * (ecef - init_ecef) and back, as LocalCoord
+void ecef2ned_batch(const Eigen::Matrix3d &ecef2ned_matrix, const Eigen::Vector3d &init_ecef, const double *ecef, double *ned, int n);
+void ned2ecef_batch(const Eigen::Matrix3d &ned2ecef_matrix, const Eigen::Vector3d &init_ecef, const double *ned, double *ecef, int n);
+
+void euler2quat_batch(const double *euler, double *quat, int n);
+void quat2euler_batch(const double *quat, double *euler, int n);
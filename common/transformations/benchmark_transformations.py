@@ -0,0 +1,57 @@
+#!/usr/bin/env python3
+"""
+Throughput of the batch coordinate and orientation conversions against calling the
+single point versions once per point, and the largest difference between the two.
+
+  ./benchmark_transformations.py
+  ./benchmark_transformations.py -n 1000000
+"""
+import argparse
+import time
+import numpy as np
+
+from openpilot.common.transformations.orientation import numpy_wrap
+from openpilot.common.transformations.transformations import (LocalCoord, ecef2geodetic_batch, ecef2geodetic_single,
+                                                              euler2quat_batch, euler2quat_single, geodetic2ecef_batch,
+                                                              geodetic2ecef_single, quat2euler_batch, quat2euler_single)
+
+
+def throughput(f, inp, iters):
+  f(inp)
+  t = time.perf_counter()
+  for _ in range(iters):
+    out = f(inp)
+  return iters * len(inp) / (time.perf_counter() - t), out
+
+
+if __name__ == "__main__":
+  parser = argparse.ArgumentParser()
+  parser.add_argument("-n", type=int, default=100000, help="points per call")
+  parser.add_argument("--iters", type=int, default=10, help="batch calls to time")
+  args = parser.parse_args()
+
+  rng = np.random.default_rng(0)
+  geodetic = np.column_stack([rng.uniform(-90, 90, args.n), rng.uniform(-180, 180, args.n), rng.uniform(-100, 5000, args.n)])
+  ecef = geodetic2ecef_batch(geodetic)
+  euler = rng.uniform(-np.pi, np.pi, (args.n, 3))
+  quat = euler2quat_batch(euler)
+  lc = LocalCoord(geodetic=[37.7, -122.4, 10.0])
+  ned = rng.uniform(-1000, 1000, (args.n, 3))
+
+  # the single point versions are slow, time them on fewer points
+  n_single = min(args.n, 10000)
+  cases = [
+    ("geodetic2ecef", geodetic, geodetic2ecef_batch, numpy_wrap(geodetic2ecef_single, (3,), (3,))),
+    ("ecef2geodetic", ecef, ecef2geodetic_batch, numpy_wrap(ecef2geodetic_single, (3,), (3,))),
+    ("ecef2ned", ecef, lc.ecef2ned_batch, numpy_wrap(lc.ecef2ned_single, (3,), (3,))),
+    ("ned2ecef", ned, lc.ned2ecef_batch, numpy_wrap(lc.ned2ecef_single, (3,), (3,))),
+    ("euler2quat", euler, euler2quat_batch, numpy_wrap(euler2quat_single, (3,), (4,))),
+    ("quat2euler", quat, quat2euler_batch, numpy_wrap(quat2euler_single, (4,), (3,))),
+  ]
+
+  print(f"{'':16s}{'batch pts/s':>14s}{'single pts/s':>14s}{'speedup':>10s}{'max diff':>12s}")
+  for name, inp, batch, single in cases:
+    batch_rate, batch_out = throughput(batch, inp, args.iters)
+    single_rate, single_out = throughput(single, inp[:n_single], 1)
+    diff = np.max(np.abs(batch_out[:n_single] - single_out))
+    print(f"{name:16s}{batch_rate:14.3g}{single_rate:14.3g}{batch_rate / single_rate:9.1f}x{diff:12.3g}")
@@ -2,10 +2,10 @@ import numpy as np
 from collections.abc import Callable
 
 from openpilot.common.transformations.transformations import (ecef_euler_from_ned_single,
-                                                    euler2quat_single,
+                                                    euler2quat_batch,
                                                     euler2rot_single,
                                                     ned_euler_from_ecef_single,
-                                                    quat2euler_single,
+                                                    quat2euler_batch,
                                                     quat2rot_single,
                                                     rot2euler_single,
                                                     rot2quat_single)
@@ -33,8 +33,8 @@ def numpy_wrap(function, input_shape, output_shape) -> Callable[..., np.ndarray]
   return f
 
 
-euler2quat = numpy_wrap(euler2quat_single, (3,), (4,))
-quat2euler = numpy_wrap(quat2euler_single, (4,), (3,))
+euler2quat = euler2quat_batch
+quat2euler = quat2euler_batch
 quat2rot = numpy_wrap(quat2rot_single, (4,), (3, 3))
 rot2quat = numpy_wrap(rot2quat_single, (3, 3), (4,))
 euler2rot = numpy_wrap(euler2rot_single, (3,), (3, 3))
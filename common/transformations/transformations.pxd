@@ -70,3 +70,14 @@ cdef extern from "coordinates.cc":
 
 cdef extern from "coordinates.hpp":
   pass
+
+cdef extern from "batch.cc":
+  pass
+
+cdef extern from "batch.hpp":
+  void geodetic2ecef_batch_c "geodetic2ecef_batch"(const double *, double *, int) nogil
+  void ecef2geodetic_batch_c "ecef2geodetic_batch"(const double *, double *, int) nogil
+  void ecef2ned_batch_c "ecef2ned_batch"(const Matrix3 &, const Vector3 &, const double *, double *, int) nogil
+  void ned2ecef_batch_c "ned2ecef_batch"(const Matrix3 &, const Vector3 &, const double *, double *, int) nogil
+  void euler2quat_batch_c "euler2quat_batch"(const double *, double *, int) nogil
+  void quat2euler_batch_c "quat2euler_batch"(const double *, double *, int) nogil
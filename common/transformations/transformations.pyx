@@ -15,6 +15,12 @@ from openpilot.common.transformations.transformations cimport ned_euler_from_ece
 from openpilot.common.transformations.transformations cimport geodetic2ecef as geodetic2ecef_c
 from openpilot.common.transformations.transformations cimport ecef2geodetic as ecef2geodetic_c
 from openpilot.common.transformations.transformations cimport LocalCoord_c
+from openpilot.common.transformations.transformations cimport geodetic2ecef_batch_c
+from openpilot.common.transformations.transformations cimport ecef2geodetic_batch_c
+from openpilot.common.transformations.transformations cimport ecef2ned_batch_c
+from openpilot.common.transformations.transformations cimport ned2ecef_batch_c
+from openpilot.common.transformations.transformations cimport euler2quat_batch_c
+from openpilot.common.transformations.transformations cimport quat2euler_batch_c
 
 
 import numpy as np
@@ -53,6 +59,52 @@ cdef Geodetic list2geodetic(geodetic):
     g.alt = geodetic[2]
     return g
 
+# The *_batch functions take a single point or an array of points ([3] or [n, 3],
+# quaternions [4] or [n, 4]) and convert them all in one call
+
+cdef tuple batch_arrays(points, int in_dim, int out_dim):
+    inp = np.ascontiguousarray(points, dtype=np.double)
+    if inp.ndim not in (1, 2) or inp.shape[inp.ndim - 1] != in_dim:
+        raise ValueError(f"expected shape ({in_dim},) or (n, {in_dim}), got {inp.shape}")
+    out = np.empty(inp.shape[:inp.ndim - 1] + (out_dim,), dtype=np.double)
+    return inp.reshape(-1, in_dim), out, out.reshape(-1, out_dim)
+
+def euler2quat_batch(euler):
+    inp, out, out_rows = batch_arrays(euler, 3, 4)
+    cdef double[:, ::1] e = inp
+    cdef double[:, ::1] q = out_rows
+    if e.shape[0] > 0:
+        with nogil:
+            euler2quat_batch_c(&e[0, 0], &q[0, 0], e.shape[0])
+    return out
+
+def quat2euler_batch(quat):
+    inp, out, out_rows = batch_arrays(quat, 4, 3)
+    cdef double[:, ::1] q = inp
+    cdef double[:, ::1] e = out_rows
+    if q.shape[0] > 0:
+        with nogil:
+            quat2euler_batch_c(&q[0, 0], &e[0, 0], q.shape[0])
+    return out
+
+def geodetic2ecef_batch(geodetic):
+    inp, out, out_rows = batch_arrays(geodetic, 3, 3)
+    cdef double[:, ::1] g = inp
+    cdef double[:, ::1] e = out_rows
+    if g.shape[0] > 0:
+        with nogil:
+            geodetic2ecef_batch_c(&g[0, 0], &e[0, 0], g.shape[0])
+    return out
+
+def ecef2geodetic_batch(ecef):
+    inp, out, out_rows = batch_arrays(ecef, 3, 3)
+    cdef double[:, ::1] e = inp
+    cdef double[:, ::1] g = out_rows
+    if e.shape[0] > 0:
+        with nogil:
+            ecef2geodetic_batch_c(&e[0, 0], &g[0, 0], e.shape[0])
+    return out
+
 def euler2quat_single(euler):
     cdef Vector3 e = Vector3(euler[0], euler[1], euler[2])
     cdef Quaternion q = euler2quat_c(e)
@@ -113,6 +165,7 @@ def ecef2geodetic_single(ecef):
 
 cdef class LocalCoord:
     cdef LocalCoord_c * lc
+    cdef Vector3 init_ecef
 
     def __init__(self, geodetic=None, ecef=None):
         assert (geodetic is not None) or (ecef is not None)
@@ -121,6 +174,9 @@ cdef class LocalCoord:
         elif ecef is not None:
             self.lc = new LocalCoord_c(list2ecef(ecef))
 
+        cdef ECEF origin = self.lc.ned2ecef(list2ned([0.0, 0.0, 0.0]))
+        self.init_ecef = Vector3(origin.x, origin.y, origin.z)
+
     @property
     def ned2ecef_matrix(self):
         return matrix2numpy(self.lc.ned2ecef_matrix)
@@ -169,5 +225,31 @@ cdef class LocalCoord:
         cdef Geodetic g = self.lc.ned2geodetic(n)
         return [g.lat, g.lon, g.alt]
 
+    def ecef2ned_batch(self, ecef):
+        assert self.lc
+        inp, out, out_rows = batch_arrays(ecef, 3, 3)
+        cdef double[:, ::1] e = inp
+        cdef double[:, ::1] n = out_rows
+        if e.shape[0] > 0:
+            with nogil:
+                ecef2ned_batch_c(self.lc.ecef2ned_matrix, self.init_ecef, &e[0, 0], &n[0, 0], e.shape[0])
+        return out
+
+    def ned2ecef_batch(self, ned):
+        assert self.lc
+        inp, out, out_rows = batch_arrays(ned, 3, 3)
+        cdef double[:, ::1] n = inp
+        cdef double[:, ::1] e = out_rows
+        if n.shape[0] > 0:
+            with nogil:
+                ned2ecef_batch_c(self.lc.ned2ecef_matrix, self.init_ecef, &n[0, 0], &e[0, 0], n.shape[0])
+        return out
+
+    def geodetic2ned_batch(self, geodetic):
+        return self.ecef2ned_batch(geodetic2ecef_batch(geodetic))
+
+    def ned2geodetic_batch(self, ned):
+        return ecef2geodetic_batch(self.ned2ecef_batch(ned))
+
     def __dealloc__(self):
         del self.lc
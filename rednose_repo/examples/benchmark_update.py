@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+"""
+Benchmark the generated update of a rednose filter for every measurement kind,
+comparing the sparse update ({name}_update_<kind>) with the dense reference
+({name}_update_dense_<kind>), and check that both give the same result.
+
+  ./benchmark_update.py
+  ./benchmark_update.py openpilot.selfdrive.locationd.models.live_kf:LiveKalman --generated selfdrive/locationd/models/generated
+"""
+import argparse
+import importlib
+import os
+import time
+import numpy as np
+
+from rednose.helpers import load_code
+
+MAX_EXTRA_ARGS = 64
+
+
+def get_dim_z(ffi, lib, name, kind, x):
+  # generated jacobians write every entry of their output, so count what H_<kind> touched
+  dim_x = len(x)
+  H = np.full(MAX_EXTRA_ARGS * dim_x, np.nan)
+  ea = np.zeros(MAX_EXTRA_ARGS)
+  getattr(lib, f"{name}_H_{kind}")(ffi.cast("double *", x.ctypes.data), ffi.cast("double *", ea.ctypes.data), ffi.cast("double *", H.ctypes.data))
+  return int(np.count_nonzero(~np.isnan(H))) // dim_x
+
+
+def time_update(ffi, func, x0, P0, z0, R, ea, iters):
+  x, P, z = x0.copy(), P0.copy(), z0.copy()
+  args = [ffi.cast("double *", a.ctypes.data) for a in (x, P, z, R, ea)]
+  t = time.perf_counter()
+  for _ in range(iters):
+    x[:], P[:], z[:] = x0, P0, z0
+    func(*args)
+  return iters / (time.perf_counter() - t)
+
+
+def run_update(ffi, func, x0, P0, z0, R, ea):
+  x, P, z = x0.copy(), P0.copy(), z0.copy()
+  func(*[ffi.cast("double *", a.ctypes.data) for a in (x, P, z, R, ea)])
+  return x, P
+
+
+def benchmark(generated_dir, name, x0, P_diag, iters, seed):
+  ffi, lib = load_code(generated_dir, name)
+  rng = np.random.default_rng(seed)
+  dim_x, dim_err = len(x0), len(P_diag)
+  kinds = sorted(int(f[len(name) + 3:]) for f in dir(lib) if f.startswith(f"{name}_h_"))
+
+  # correlated covariance, so the update can't get away with a diagonal P
+  A = rng.normal(size=(dim_err, dim_err)) * np.sqrt(P_diag)[:, None] * 0.1
+  P0 = np.ascontiguousarray(np.diag(P_diag) + A @ A.T)
+  x0 = np.ascontiguousarray(x0, dtype=np.float64)
+  ea = np.zeros(MAX_EXTRA_ARGS)
+
+  print(f"{name}: dim_x {dim_x}, dim_err {dim_err}, {iters} updates per kind")
+  print(f"{'kind':>6} {'dim_z':>6} {'dense/s':>10} {'sparse/s':>10} {'speedup':>8} {'max dx err':>11} {'max dP err':>11}")
+  for kind in kinds:
+    dim_z = get_dim_z(ffi, lib, name, kind, x0)
+    hx = np.zeros(dim_z)
+    getattr(lib, f"{name}_h_{kind}")(ffi.cast("double *", x0.ctypes.data), ffi.cast("double *", ea.ctypes.data), ffi.cast("double *", hx.ctypes.data))
+    z0 = hx + rng.normal(size=dim_z) * 0.1
+    R = np.ascontiguousarray(np.eye(dim_z) * 0.1**2)
+
+    sparse = getattr(lib, f"{name}_update_{kind}")
+    dense = getattr(lib, f"{name}_update_dense_{kind}")
+
+    x_s, P_s = run_update(ffi, sparse, x0, P0, z0, R, ea)
+    x_d, P_d = run_update(ffi, dense, x0, P0, z0, R, ea)
+    dx_err = np.max(np.abs(x_s - x_d))
+    dP_err = np.max(np.abs(P_s - P_d)) / np.max(np.abs(P_d))
+
+    dense_rate = time_update(ffi, dense, x0, P0, z0, R, ea, iters)
+    sparse_rate = time_update(ffi, sparse, x0, P0, z0, R, ea, iters)
+    print(f"{kind:>6} {dim_z:>6} {dense_rate:>10.0f} {sparse_rate:>10.0f} {sparse_rate / dense_rate:>7.2f}x {dx_err:>11.2e} {dP_err:>11.2e}")
+
+  Q = np.diag(P_diag) * 1e-3
+  predict_args = lambda x, P: (ffi.cast("double *", x.ctypes.data), ffi.cast("double *", P.ctypes.data), ffi.cast("double *", Q.ctypes.data), 0.05)
+  rates = []
+  for func in (getattr(lib, f"{name}_predict_dense"), getattr(lib, f"{name}_predict")):
+    x, P = x0.copy(), P0.copy()
+    args = predict_args(x, P)
+    t = time.perf_counter()
+    for _ in range(iters):
+      x[:], P[:] = x0, P0
+      func(*args)
+    rates.append(iters / (time.perf_counter() - t))
+  print(f"{'predict':>13} {rates[0]:>10.0f} {rates[1]:>10.0f} {rates[1] / rates[0]:>7.2f}x")
+
+
+if __name__ == "__main__":
+  parser = argparse.ArgumentParser(description="Benchmark sparse vs dense rednose updates",
+                                   formatter_class=argparse.ArgumentDefaultsHelpFormatter)
+  parser.add_argument("filter", nargs="?", default="examples.live_kf:LiveKalman", help="module:Class with name, initial_x and initial_P_diag")
+  parser.add_argument("--generated", help="directory with the compiled filter, defaults to generated/ next to the filter module")
+  parser.add_argument("--iters", type=int, default=20000)
+  parser.add_argument("--seed", type=int, default=0)
+  args = parser.parse_args()
+
+  module_name, class_name = args.filter.split(":")
+  module = importlib.import_module(module_name)
+  kf = getattr(module, class_name)
+  generated_dir = args.generated or os.path.join(os.path.dirname(module.__file__), "generated")
+
+  benchmark(generated_dir, kf.name, kf.initial_x, kf.initial_P_diag, args.iters, args.seed)
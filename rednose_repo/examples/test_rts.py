@@ -0,0 +1,70 @@
+import copy
+import os
+import unittest
+import numpy as np
+
+from rednose.helpers.ekf_sym import EKF_sym
+from rednose.helpers.ekf_sym_pyx import EKF_sym_pyx, RTSStream_pyx  # pylint: disable=no-name-in-module
+
+from .kinematic_kf import KinematicKalman, ObservationKind
+
+GENERATED_DIR = os.path.abspath(os.path.join(os.path.dirname(__file__), "generated"))
+
+
+class TestRTS(unittest.TestCase):
+  def setUp(self):
+    np.random.seed(0)
+    args = (GENERATED_DIR, KinematicKalman.name, KinematicKalman.Q, KinematicKalman.initial_x,
+            np.diag(KinematicKalman.initial_P_diag), 2, 2)
+    self.ekf = EKF_sym(*args)
+    self.ekf_pyx = EKF_sym_pyx(*args)
+
+    # accelerating object, position observed at 100Hz
+    dt = 0.01
+    R = KinematicKalman.obs_noise[ObservationKind.POSITION]
+    self.estimates = []
+    for i in range(300):
+      t = i * dt
+      z = np.array([np.sin(t) + np.random.normal(scale=0.1)])
+      self.estimates.append(self.ekf.predict_and_update_batch(t, ObservationKind.POSITION, np.array([z]), np.array([R])))
+
+  def test_matches_ekf_sym(self):
+    # EKF_sym.rts_smooth starts the backward pass from the predicted estimate of the
+    # last step and RTSSmoother from the filtered one, give both the predicted one
+    last = list(self.estimates[-1])
+    last[1], last[3] = last[0], last[2]
+    estimates = self.estimates[:-1] + [tuple(last)]
+
+    # EKF_sym.rts_smooth writes into the estimates it's given
+    xs_ref, Ps_ref = self.ekf.rts_smooth(copy.deepcopy(estimates))
+    xs, Ps = self.ekf_pyx.rts_smooth(estimates)
+    np.testing.assert_allclose(xs, xs_ref, rtol=1e-9, atol=1e-12)
+    np.testing.assert_allclose(Ps, Ps_ref, rtol=1e-9, atol=1e-12)
+
+  def test_chunked_and_stream(self):
+    xs, Ps = self.ekf_pyx.rts_smooth(self.estimates)
+
+    # a lag past the end of the run makes every chunk see the whole run
+    xs_c, Ps_c = self.ekf_pyx.rts_smooth(self.estimates, chunk_len=50, lag=len(self.estimates), n_threads=2)
+    np.testing.assert_allclose(xs_c, xs, rtol=1e-9, atol=1e-12)
+    np.testing.assert_allclose(Ps_c, Ps, rtol=1e-9, atol=1e-12)
+
+    # the stream smooths the same chunks as rts_smooth with the same chunk_len and lag
+    xs_c, Ps_c = self.ekf_pyx.rts_smooth(self.estimates, chunk_len=50, lag=40)
+    stream = RTSStream_pyx(self.ekf_pyx, 50, 40)
+    smoothed = []
+    for estimate in self.estimates:
+      stream.push(estimate)
+      while (s := stream.pop()) is not None:
+        smoothed.append(s)
+    stream.flush()
+    while (s := stream.pop()) is not None:
+      smoothed.append(s)
+
+    self.assertEqual([s[0] for s in smoothed], [e[4] for e in self.estimates])
+    np.testing.assert_allclose(np.array([s[1] for s in smoothed]), xs_c, rtol=1e-9, atol=1e-12)
+    np.testing.assert_allclose(np.array([s[2] for s in smoothed]), Ps_c, rtol=1e-9, atol=1e-12)
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -22,7 +22,7 @@ def load_code(folder, name):
     header = f.read()
 
   # is the only thing that can be parsed by cffi
-  header = "\n".join([line for line in header.split("\n") if line.startswith("void ")])
+  header = "\n".join([line for line in header.split("\n") if line.startswith(("void ", "int "))])
 
   ffi = FFI()
   ffi.cdef(header)
@@ -0,0 +1,202 @@
+#include "ekf_rts.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <thread>
+
+using namespace EKFS;
+using namespace Eigen;
+
+namespace {
+
+// runs fn(0) ... fn(n_jobs - 1) on up to n_threads threads
+template <typename Fn>
+void run_parallel(int n_jobs, int n_threads, const Fn &fn) {
+  n_threads = std::max(1, std::min(n_threads, n_jobs));
+  std::atomic<int> next(0);
+  auto worker = [&]() {
+    for (int j = next++; j < n_jobs; j = next++) {
+      fn(j);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (int i = 1; i < n_threads; i++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+}  // namespace
+
+RTSSmoother::RTSSmoother(std::string name, int dim_x, int dim_err, int dim_main, int dim_main_err, std::vector<int> quaternion_idxs) {
+  this->ekf = ekf_lookup(name);
+  assert(this->ekf);
+
+  this->dim_x = dim_x;
+  this->dim_err = dim_err;
+  this->dim_main = dim_main;
+  this->dim_main_err = dim_main_err;
+  this->quaternion_idxs = quaternion_idxs;
+}
+
+FilterStep RTSSmoother::step(const Estimate &estimate) {
+  return { estimate.t, estimate.xk1.data(), estimate.xk.data(), estimate.Pk1.data(), estimate.Pk.data() };
+}
+
+std::vector<FilterStep> RTSSmoother::steps(const std::vector<Estimate> &estimates) {
+  std::vector<FilterStep> steps;
+  steps.reserve(estimates.size());
+  for (const Estimate &estimate : estimates) {
+    steps.push_back(RTSSmoother::step(estimate));
+  }
+  return steps;
+}
+
+void RTSSmoother::smooth(const std::vector<FilterStep> &steps, double *x_out, double *P_out,
+                         int chunk_len, int lag, int n_threads, std::vector<int> segment_starts) const {
+  int n = steps.size();
+  segment_starts.push_back(0);
+  segment_starts.push_back(n);
+  std::sort(segment_starts.begin(), segment_starts.end());
+  segment_starts.erase(std::unique(segment_starts.begin(), segment_starts.end()), segment_starts.end());
+
+  // one job per chunk: output [begin, end), backward pass starting at end + lag
+  struct Job { int begin, end, window_end; };
+  std::vector<Job> jobs;
+  for (int s = 0; s + 1 < (int)segment_starts.size(); s++) {
+    int seg_begin = segment_starts[s], seg_end = segment_starts[s + 1];
+    assert(0 <= seg_begin && seg_end <= n);
+    int len = chunk_len > 0 ? chunk_len : seg_end - seg_begin;
+    for (int begin = seg_begin; begin < seg_end; begin += len) {
+      int end = std::min(begin + len, seg_end);
+      jobs.push_back({ begin, end, std::min(end + std::max(lag, 0), seg_end) });
+    }
+  }
+
+  run_parallel(jobs.size(), n_threads, [&](int j) {
+    const Job &job = jobs[j];
+    this->smooth_window(steps.data() + job.begin, job.window_end - job.begin, job.end - job.begin,
+                        x_out + (size_t)job.begin * this->dim_x, P_out + (size_t)job.begin * this->dim_err * this->dim_err);
+  });
+}
+
+void RTSSmoother::smooth_window(const FilterStep *steps, int n, int n_out, double *x_out, double *P_out) const {
+  typedef Map<const VectorXd> CVM;
+  typedef Map<const MatrixXdr> CMM;
+  int d1 = this->dim_main;
+  int d2 = this->dim_main_err;
+  int dx = this->dim_x;
+  int de = this->dim_err;
+
+  auto write = [&](int k, VectorXd &x, const MatrixXdr &P) {
+    for (int idx : this->quaternion_idxs) {
+      x.segment<4>(idx).normalize();
+    }
+    if (k < n_out) {
+      Map<VectorXd>(x_out + (size_t)k * dx, dx) = x;
+      Map<MatrixXdr>(P_out + (size_t)k * de * de, de, de) = P;
+    }
+  };
+
+  VectorXd xk_n = CVM(steps[n - 1].xk, dx);
+  MatrixXdr Pk_n = CMM(steps[n - 1].Pk, de, de);
+  write(n - 1, xk_n, Pk_n);
+
+  VectorXd xk_k(dx), xk1_k(dx), x_new(dx);
+  VectorXd delta_x(de);
+  MatrixXdr F(de, de), Ck(d2, d2);
+  for (int k = n - 2; k >= 0; k--) {
+    // xk_n and Pk_n are the smoothed estimate of step k + 1
+    xk1_k = CVM(steps[k + 1].xk1, dx);
+    CMM Pk1_k(steps[k + 1].Pk1, de, de);
+    xk_k = CVM(steps[k].xk, dx);
+    CMM Pk_k(steps[k].Pk, de, de);
+    double dt = steps[k + 1].t - steps[k].t;
+    this->ekf->F_fun(xk_k.data(), dt, F.data());
+
+    // smoother gain C = P_k F^T P_k+1|k^-1, on the main state only
+    Ck = Pk1_k.topLeftCorner(d2, d2).ldlt().solve(F.topLeftCorner(d2, d2) * Pk_k.topLeftCorner(d2, d2).transpose()).transpose();
+
+    this->ekf->inv_err_fun(xk1_k.data(), xk_n.data(), delta_x.data());
+    delta_x.head(d2) = (Ck * delta_x.head(d2)).eval();
+    this->ekf->err_fun(xk_k.data(), delta_x.data(), x_new.data());
+
+    MatrixXdr dP = Ck * (Pk_n.topLeftCorner(d2, d2) - Pk1_k.topLeftCorner(d2, d2)) * Ck.transpose();
+    xk_n = xk_k;
+    xk_n.head(d1) = x_new.head(d1);
+    Pk_n = Pk_k;
+    Pk_n.topLeftCorner(d2, d2) += dP;
+    write(k, xk_n, Pk_n);
+  }
+}
+
+RTSStream::RTSStream(const RTSSmoother *smoother, int chunk_len, int lag) {
+  assert(chunk_len > 0 && lag >= 0);
+  this->smoother = smoother;
+  this->chunk_len = chunk_len;
+  this->lag = lag;
+}
+
+void RTSStream::push(const Estimate &estimate) {
+  this->pending.push_back(estimate);
+  if ((int)this->pending.size() >= this->chunk_len + this->lag) {
+    this->smooth_chunk(this->chunk_len);
+  }
+}
+
+void RTSStream::push(const FilterStep &step) {
+  int dx = this->smoother->get_dim_x();
+  int de = this->smoother->get_dim_err();
+  Estimate estimate;
+  estimate.t = step.t;
+  estimate.xk1 = Map<const VectorXd>(step.xk1, dx);
+  estimate.xk = Map<const VectorXd>(step.xk, dx);
+  estimate.Pk1 = Map<const MatrixXdr>(step.Pk1, de, de);
+  estimate.Pk = Map<const MatrixXdr>(step.Pk, de, de);
+  this->pending.push_back(std::move(estimate));
+  if ((int)this->pending.size() >= this->chunk_len + this->lag) {
+    this->smooth_chunk(this->chunk_len);
+  }
+}
+
+void RTSStream::flush() {
+  if (!this->pending.empty()) {
+    this->smooth_chunk(this->pending.size());
+  }
+}
+
+bool RTSStream::pop(Smoothed &out) {
+  if (this->ready.empty()) {
+    return false;
+  }
+  out = std::move(this->ready.front());
+  this->ready.pop_front();
+  return true;
+}
+
+void RTSStream::smooth_chunk(int n_out) {
+  int dx = this->smoother->get_dim_x();
+  int de = this->smoother->get_dim_err();
+  std::vector<FilterStep> steps;
+  steps.reserve(this->pending.size());
+  for (const Estimate &estimate : this->pending) {
+    steps.push_back(RTSSmoother::step(estimate));
+  }
+
+  // backward pass over the whole window, only the chunk is kept
+  this->x_buf.resize((size_t)n_out * dx);
+  this->P_buf.resize((size_t)n_out * de * de);
+  this->smoother->smooth_window(steps.data(), steps.size(), n_out, this->x_buf.data(), this->P_buf.data());
+
+  for (int k = 0; k < n_out; k++) {
+    this->ready.push_back({ this->pending.front().t,
+                            Map<VectorXd>(this->x_buf.data() + (size_t)k * dx, dx),
+                            Map<MatrixXdr>(this->P_buf.data() + (size_t)k * de * de, de, de) });
+    this->pending.pop_front();
+  }
+}
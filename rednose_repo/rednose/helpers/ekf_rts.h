@@ -0,0 +1,100 @@
+#pragma once
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <eigen3/Eigen/Dense>
+
+#include "ekf.h"
+#include "ekf_load.h"
+#include "ekf_sym.h"
+
+namespace EKFS {
+
+// One filter step as seen by the smoother, pointers into an Estimate or into
+// stacked arrays: xk1/xk [dim_x], Pk1/Pk [dim_err, dim_err] row major
+typedef struct FilterStep {
+  double t;
+  const double *xk1;
+  const double *xk;
+  const double *Pk1;
+  const double *Pk;
+} FilterStep;
+
+typedef struct Smoothed {
+  double t;
+  Eigen::VectorXd x;
+  MatrixXdr P;
+} Smoothed;
+
+// Rauch-Tung-Striebel smoother over the estimates of an EKFSym run, same math as
+// EKF_sym.rts_smooth but starting the backward pass from the filtered (not the
+// predicted) estimate of the last step. If the state is augmented with old states
+// only the main state (dim_main, dim_main_err) is smoothed, the rest is passed through.
+//
+// The backward pass can be split into chunks of chunk_len steps. Each chunk starts
+// its backward pass from the filtered estimate lag steps past its end, so chunks
+// are independent and run on n_threads, and a stream only has to keep
+// chunk_len + lag estimates around. With lag = 0 chunks are smoothed on their own,
+// a lag of a few times the slowest time constant of the filter gives results
+// indistinguishable from a single pass. Segments that were filtered independently
+// (e.g. separate drives, or after init_state) are never smoothed across.
+class RTSSmoother {
+public:
+  RTSSmoother(std::string name, int dim_x, int dim_err, int dim_main, int dim_main_err, std::vector<int> quaternion_idxs = {});
+
+  static FilterStep step(const Estimate &estimate);
+  static std::vector<FilterStep> steps(const std::vector<Estimate> &estimates);
+
+  // writes the smoothed states [n, dim_x] and covariances [n, dim_err, dim_err] of
+  // steps to x_out and P_out. chunk_len = 0 smooths each segment in one pass,
+  // segment_starts are the indices where new independent segments start
+  void smooth(const std::vector<FilterStep> &steps, double *x_out, double *P_out,
+              int chunk_len = 0, int lag = 0, int n_threads = 1, std::vector<int> segment_starts = {}) const;
+
+  int get_dim_x() const { return this->dim_x; }
+  int get_dim_err() const { return this->dim_err; }
+
+private:
+  friend class RTSStream;
+
+  // backward pass over steps[0, n), smoothed results for the first n_out are written
+  void smooth_window(const FilterStep *steps, int n, int n_out, double *x_out, double *P_out) const;
+
+  const EKF *ekf = NULL;
+  int dim_main;
+  int dim_main_err;
+  int dim_x;
+  int dim_err;
+  std::vector<int> quaternion_idxs;
+};
+
+// Streaming smoother for logs that don't fit in memory, estimates are pushed in
+// order and smoothed a chunk at a time once lag more estimates arrived. At most
+// chunk_len + lag estimates are kept.
+class RTSStream {
+public:
+  RTSStream(const RTSSmoother *smoother, int chunk_len, int lag);
+
+  void push(const Estimate &estimate);
+  // same as push(Estimate), the step's arrays are copied
+  void push(const FilterStep &step);
+  // smooths what is left, call at the end of a segment before pushing the next one
+  void flush();
+  // pops the next smoothed estimate in order, false if none is ready
+  bool pop(Smoothed &out);
+
+private:
+  void smooth_chunk(int n_out);
+
+  const RTSSmoother *smoother;
+  int chunk_len;
+  int lag;
+  std::deque<Estimate> pending;
+  std::deque<Smoothed> ready;
+  std::vector<double> x_buf;
+  std::vector<double> P_buf;
+};
+
+}  // namespace EKFS
@@ -26,6 +26,11 @@ def null(H, eps=1e-12):
   return np.transpose(null_space)
 
 
+def sparsity(sym):
+  # structural nonzeros of a sympy matrix, numerical zeros (e.g. from np.eye) count as zero
+  return np.array([[not (e.is_number and e.is_zero) for e in sym.row(i)] for i in range(sym.shape[0])], dtype=bool)
+
+
 def gen_code(folder, name, f_sym, dt_sym, x_sym, obs_eqs, dim_x, dim_err, eskf_params=None, msckf_params=None,  # pylint: disable=dangerous-default-value
              maha_test_kinds=[], quaternion_idxs=[], global_vars=None, extra_routines=[]):
   # optional state transition matrix, H modifier
@@ -126,12 +131,30 @@ def gen_code(folder, name, f_sym, dt_sym, x_sym, obs_eqs, dim_x, dim_err, eskf_p
   pre_code += "#define MEDIM %d\n" % dim_main_err
   pre_code += "typedef void (*Hfun)(double *, double *, double *);\n"
 
+  # sparsity of the main block of F as CSR, for predict_sparse
+  F_main_nz = sparsity(F_sym)[:dim_main_err, :dim_main_err]
+  F_row_ptr = np.concatenate(([0], np.cumsum(F_main_nz.sum(axis=1))))
+  F_col_idx = np.nonzero(F_main_nz)[1]
+  pre_code += f"const static int F_ROW_PTR[MEDIM + 1] = {{ {', '.join(str(i) for i in F_row_ptr)} }};\n"
+  pre_code += f"const static int F_COL_IDX[{max(len(F_col_idx), 1)}] = {{ {', '.join(str(i) for i in F_col_idx) or '0'} }};\n"
+  H_mod_nz = sparsity(H_mod_sym)
+
   if global_vars is not None:
     for var in global_vars:
       pre_code += f"\ndouble {var.name};\n"
       pre_code += f"\nvoid set_{var.name}(double x){{ {var.name} = x;}}\n"
 
-  post_code = "\n}\n" # namespace
+  # kinds that can go through update_stacked, everything but null space projected updates
+  stacked_kinds = [(h_sym, kind, ea_sym) for h_sym, kind, ea_sym, _, _ in obs_eqs if not (msckf and kind in feature_track_kinds)]
+  post_code = ""
+  if stacked_kinds:
+    post_code += "\nconst StackedObs STACKED_OBS[] = {\n"
+    for h_sym, kind, ea_sym in stacked_kinds:
+      ea_dim = ea_sym.shape[0] if ea_sym is not None else 0
+      post_code += f"  {{ {kind}, {h_sym.shape[0]}, {ea_dim}, h_{kind}, H_{kind}, {str(kind in maha_test_kinds).lower()}, MAHA_THRESH_{kind} }},\n"
+    post_code += "};\n"
+
+  post_code += "\n}\n" # namespace
   post_code += "extern \"C\" {\n\n"
 
   for h_sym, kind, ea_sym, H_sym, He_sym in obs_eqs:
@@ -146,8 +169,23 @@ def gen_code(folder, name, f_sym, dt_sym, x_sym, obs_eqs, dim_x, dim_err, eskf_p
 
     pre_code += f"const static double MAHA_THRESH_{kind} = {maha_thresh};\n"
 
+    # nonzero columns of the error-state jacobian H * H_mod, for update_sparse
+    H_err_cols = np.nonzero((sparsity(H_sym).astype(int) @ H_mod_nz.astype(int)).any(axis=0))[0]
+    sparse_update = He_str == 'NULL' and len(H_err_cols) > 0
+    if sparse_update:
+      pre_code += f"const static int H_COLS_{kind}[{len(H_err_cols)}] = {{ {', '.join(str(i) for i in H_err_cols)} }};\n"
+
     header += f"void {name}_update_{kind}(double *in_x, double *in_P, double *in_z, double *in_R, double *in_ea);\n"
     post_code += f"void {name}_update_{kind}(double *in_x, double *in_P, double *in_z, double *in_R, double *in_ea) {{\n"
+    if sparse_update:
+      post_code += f"  update_sparse<{h_sym.shape[0]}, {len(H_err_cols)}, {int(maha_test)}>(in_x, in_P, h_{kind}, H_{kind}, in_z, in_R, in_ea, MAHA_THRESH_{kind}, H_COLS_{kind});\n"
+    else:
+      post_code += f"  update<{h_sym.shape[0]}, 3, {int(maha_test)}>(in_x, in_P, h_{kind}, H_{kind}, {He_str}, in_z, in_R, in_ea, MAHA_THRESH_{kind});\n"
+    post_code += "}\n"
+
+    # dense reference, for benchmarking and checking the sparse update
+    header += f"void {name}_update_dense_{kind}(double *in_x, double *in_P, double *in_z, double *in_R, double *in_ea);\n"
+    post_code += f"void {name}_update_dense_{kind}(double *in_x, double *in_P, double *in_z, double *in_R, double *in_ea) {{\n"
     post_code += f"  update<{h_sym.shape[0]}, 3, {int(maha_test)}>(in_x, in_P, h_{kind}, H_{kind}, {He_str}, in_z, in_R, in_ea, MAHA_THRESH_{kind});\n"
     post_code += "}\n"
 
@@ -159,8 +197,20 @@ def gen_code(folder, name, f_sym, dt_sym, x_sym, obs_eqs, dim_x, dim_err, eskf_p
       post_code += f"void {name}_{func_call} {{\n"
       post_code += f"  {func_call.replace('double *', '').replace('double', '')};\n"
       post_code += "}\n"
+  header += f"int {name}_update_stacked(int n, int *kinds, double *in_x, double *in_P, double *in_z, double *in_R, double *in_ea);\n"
+  post_code += f"int {name}_update_stacked(int n, int *kinds, double *in_x, double *in_P, double *in_z, double *in_R, double *in_ea) {{\n"
+  post_code += f"  return update_stacked(in_x, in_P, n, kinds, in_z, in_R, in_ea, {'STACKED_OBS' if stacked_kinds else 'NULL'}, {len(stacked_kinds)});\n"
+  post_code += "}\n"
+  header += f"int {name}_stacked_dims(int kind, int *dim, int *ea_dim);\n"
+  post_code += f"int {name}_stacked_dims(int kind, int *dim, int *ea_dim) {{\n"
+  post_code += f"  return stacked_dims(kind, dim, ea_dim, {'STACKED_OBS' if stacked_kinds else 'NULL'}, {len(stacked_kinds)});\n"
+  post_code += "}\n"
   header += f"void {name}_predict(double *in_x, double *in_P, double *in_Q, double dt);\n"
   post_code += f"void {name}_predict(double *in_x, double *in_P, double *in_Q, double dt) {{\n"
+  post_code += "  predict_sparse(in_x, in_P, in_Q, dt);\n"
+  post_code += "}\n"
+  header += f"void {name}_predict_dense(double *in_x, double *in_P, double *in_Q, double dt);\n"
+  post_code += f"void {name}_predict_dense(double *in_x, double *in_P, double *in_Q, double dt) {{\n"
   post_code += "  predict(in_x, in_P, in_Q, dt);\n"
   post_code += "}\n"
   if global_vars is not None:
@@ -204,7 +254,9 @@ def gen_code(folder, name, f_sym, dt_sym, x_sym, obs_eqs, dim_x, dim_err, eskf_p
 
   # merge code blocks
   header += "}"
-  code = "\n".join([pre_code, code, open(os.path.join(TEMPLATE_DIR, "ekf_c.c"), encoding='utf-8').read(), post_code])
+  code = "\n".join([pre_code, code, open(os.path.join(TEMPLATE_DIR, "ekf_c.c"), encoding='utf-8').read(),
+                    open(os.path.join(TEMPLATE_DIR, "ekf_sparse_c.c"), encoding='utf-8').read(),
+                    open(os.path.join(TEMPLATE_DIR, "ekf_stacked_c.c"), encoding='utf-8').read(), post_code])
 
   # write to file
   if not os.path.exists(folder):
@@ -216,8 +268,13 @@ def gen_code(folder, name, f_sym, dt_sym, x_sym, obs_eqs, dim_x, dim_err, eskf_p
 
 class EKF_sym():
   def __init__(self, folder, name, Q, x_initial, P_initial, dim_main, dim_main_err,  # pylint: disable=dangerous-default-value
-               N=0, dim_augment=0, dim_augment_err=0, maha_test_kinds=[], quaternion_idxs=[], global_vars=None, max_rewind_age=1.0, logger=logging):
-    """Generates process function and all observation functions for the kalman filter."""
+               N=0, dim_augment=0, dim_augment_err=0, maha_test_kinds=[], quaternion_idxs=[], global_vars=None, max_rewind_age=1.0, logger=logging,
+               rewind_checkpoint_interval=1):
+    """Generates process function and all observation functions for the kalman filter.
+    Every observation is kept for rewinding, but the state and covariance are only
+    snapshotted every rewind_checkpoint_interval observations. A late observation
+    replays from the nearest snapshot before it, so a larger interval trades replay
+    depth for less copying on every update."""
     self.msckf = N > 0
     self.N = N
     self.dim_augment = dim_augment
@@ -246,10 +303,14 @@ class EKF_sym():
     self.Q = Q
 
     # rewind stuff
+    assert rewind_checkpoint_interval >= 1
     self.max_rewind_age = max_rewind_age
+    self.rewind_checkpoint_interval = rewind_checkpoint_interval
     self.rewind_t = []
     self.rewind_states = []
     self.rewind_obscache = []
+    self.rewind_since_snapshot = 0
+    self.reset_rewind_stats()
     self.init_state(x_initial, P_initial, None)
 
     ffi, lib = load_code(folder, name)
@@ -339,25 +400,60 @@ class EKF_sym():
     def _update_blas(x, P, kind, z, R, extra_args=[]):  # pylint: disable=dangerous-default-value
         return self._updates[kind](x, P, z, R, extra_args)
 
+    # wrap the C++ stacked update, filters generated before it existed don't have one
+    update_stacked = getattr(lib, f"{name}_update_stacked", None)
+
+    def _update_stacked_blas(x, P, kinds, z, R, extra_args):
+      bad = update_stacked(len(kinds), ffi.new("int[]", list(kinds)),
+                           ffi.cast("double *", x.ctypes.data),
+                           ffi.cast("double *", P.ctypes.data),
+                           ffi.cast("double *", z.ctypes.data),
+                           ffi.cast("double *", R.ctypes.data),
+                           ffi.cast("double *", extra_args.ctypes.data))
+      if bad >= 0:
+        raise ValueError(f"observation kind {kinds[bad]} can't be used in a stacked update")
+      return x, P, z
+
+    # (dim_z, number of extra args) of every kind the stacked update takes
+    self.stacked_dims = {}
+    stacked_dims = getattr(lib, f"{name}_stacked_dims", None)
+    if stacked_dims is not None:
+      dim, ea_dim = ffi.new("int *"), ffi.new("int *")
+      for kind in kinds:
+        if stacked_dims(kind, dim, ea_dim):
+          self.stacked_dims[kind] = (dim[0], ea_dim[0])
+
     # assign the functions
     self._predict = _predict_blas
     # self._predict = self._predict_python
     self._update = _update_blas
     # self._update = self._update_python
+    self._update_stacked = _update_stacked_blas if update_stacked is not None else None
 
   def init_state(self, state, covs, filter_time):
     self.x = np.array(state.reshape((-1, 1))).astype(np.float64)
     self.P = np.array(covs).astype(np.float64)
     self.filter_time = filter_time
     self.augment_times = [0] * self.N
-    self.rewind_obscache = []
-    self.rewind_t = []
-    self.rewind_states = []
+    self.reset_rewind()
 
   def reset_rewind(self):
     self.rewind_obscache = []
     self.rewind_t = []
     self.rewind_states = []
+    self.rewind_since_snapshot = self.rewind_checkpoint_interval  # snapshot the next observation
+
+  def reset_rewind_stats(self):
+    self.rewind_stats = {
+      'rewinds': 0,       # late observations that were rewound for
+      'dropped': 0,       # late observations too old to rewind for
+      'replayed': 0,      # observations replayed in total
+      'last_depth': 0,    # observations replayed for the last rewind
+      'max_depth': 0,     # most observations replayed for a single rewind
+    }
+
+  def get_rewind_stats(self):
+    return dict(self.rewind_stats)
 
   def augment(self):
     # TODO this is not a generalized way of doing this and implies that the augmented states
@@ -412,39 +508,66 @@ class EKF_sym():
   def set_global(self, global_var, val):
     self.set_globals[global_var](val)
 
+  def _rewind_snapshot_idx(self, t):
+    # last snapshot taken at or before t, None if there is none
+    idx = bisect_right(self.rewind_t, t) - 1
+    while idx >= 0 and self.rewind_states[idx] is None:
+      idx -= 1
+    return idx if idx >= 0 else None
+
   def rewind(self, t):
     # find where we are rewinding to
     idx = bisect_right(self.rewind_t, t)
     assert self.rewind_t[idx - 1] <= t
     assert self.rewind_t[idx] > t    # must be true, or rewind wouldn't be called
+    snap = self._rewind_snapshot_idx(t)
 
-    # set the state to the time right before that
-    self.filter_time = self.rewind_t[idx - 1]
-    self.x[:] = self.rewind_states[idx - 1][0]
-    self.P[:] = self.rewind_states[idx - 1][1]
+    # set the state to the nearest snapshot before that
+    self.filter_time = self.rewind_t[snap]
+    self.x[:] = self.rewind_states[snap][0]
+    self.P[:] = self.rewind_states[snap][1]
 
-    # return the observations we rewound over for fast forwarding
+    # observations between the snapshot and t are replayed now, the ones after t are
+    # returned for fast forwarding
+    replay = self.rewind_obscache[snap + 1:idx]
     ret = self.rewind_obscache[idx:]
 
     # throw away the old future
-    # TODO: is this making a copy?
-    self.rewind_t = self.rewind_t[:idx]
-    self.rewind_states = self.rewind_states[:idx]
-    self.rewind_obscache = self.rewind_obscache[:idx]
-
+    del self.rewind_t[snap + 1:]
+    del self.rewind_states[snap + 1:]
+    del self.rewind_obscache[snap + 1:]
+    self.rewind_since_snapshot = 0
+
+    depth = len(replay) + len(ret)
+    self.rewind_stats['rewinds'] += 1
+    self.rewind_stats['replayed'] += depth
+    self.rewind_stats['last_depth'] = depth
+    self.rewind_stats['max_depth'] = max(self.rewind_stats['max_depth'], depth)
+
+    self._fast_forward(replay)
     return ret
 
   def checkpoint(self, obs):
-    # push to rewinder
+    # push to rewinder, the state is only snapshotted every rewind_checkpoint_interval observations
+    self.rewind_since_snapshot += 1
+    if self.rewind_since_snapshot >= self.rewind_checkpoint_interval:
+      self.rewind_states.append((np.copy(self.x), np.copy(self.P)))
+      self.rewind_since_snapshot = 0
+    else:
+      self.rewind_states.append(None)
     self.rewind_t.append(self.filter_time)
-    self.rewind_states.append((np.copy(self.x), np.copy(self.P)))
     self.rewind_obscache.append(obs)
 
-    # only keep a certain number around
+    # only keep a certain number around. Nothing before the oldest snapshot can be rewound to,
+    # so entries are dropped up to the next snapshot and the oldest entry kept always has one
     REWIND_TO_KEEP = 512
-    self.rewind_t = self.rewind_t[-REWIND_TO_KEEP:]
-    self.rewind_states = self.rewind_states[-REWIND_TO_KEEP:]
-    self.rewind_obscache = self.rewind_obscache[-REWIND_TO_KEEP:]
+    if len(self.rewind_t) > REWIND_TO_KEEP:
+      n = len(self.rewind_t) - REWIND_TO_KEEP
+      while n < len(self.rewind_states) and self.rewind_states[n] is None:
+        n += 1
+      del self.rewind_t[:n]
+      del self.rewind_states[:n]
+      del self.rewind_obscache[:n]
 
   def predict(self, t):
     # initialize time
@@ -458,26 +581,116 @@ class EKF_sym():
     self.normalize_quaternions()
     self.filter_time = t
 
+  def _rewind_for(self, t):
+    # rewind if the observation is older than the filter, returns the observations to fast forward
+    # over afterwards, or None if it is too old to rewind to
+    if self.filter_time is not None and t < self.filter_time:
+      if len(self.rewind_t) == 0 or t < self.rewind_t[-1] - self.max_rewind_age or self._rewind_snapshot_idx(t) is None:
+        self.logger.error(f"observation too old at {t:.3f} with filter at {self.filter_time:.3f}, ignoring")
+        self.rewind_stats['dropped'] += 1
+        return None
+      return self.rewind(t)
+    return []
+
+  def _fast_forward(self, rewound):
+    for t, kind, z, R, extra_args in rewound:
+      if isinstance(kind, tuple):  # stacked observations
+        self._predict_and_update_stacked(t, kind, z, R, extra_args)
+      else:
+        self._predict_and_update_batch(t, kind, z, R, extra_args)
+
   def predict_and_update_batch(self, t, kind, z, R, extra_args=[[]], augment=False):  # pylint: disable=dangerous-default-value
     # TODO handle rewinding at this level"
 
     # rewind
-    if self.filter_time is not None and t < self.filter_time:
-      if len(self.rewind_t) == 0 or t < self.rewind_t[0] or t < self.rewind_t[-1] - self.max_rewind_age:
-        self.logger.error(f"observation too old at {t:.3f} with filter at {self.filter_time:.3f}, ignoring")
-        return None
-      rewound = self.rewind(t)
-    else:
-      rewound = []
+    rewound = self._rewind_for(t)
+    if rewound is None:
+      return None
 
     ret = self._predict_and_update_batch(t, kind, z, R, extra_args, augment)
 
     # optional fast forward
-    for r in rewound:
-      self._predict_and_update_batch(*r)
+    self._fast_forward(rewound)
 
     return ret
 
+  def predict_and_update_stacked(self, t, kinds, z, R, extra_args=None, augment=False):
+    """Predicts the state and then updates with one observation of each kind in kinds,
+    all taken at time t, as a single stacked update (one gain solve instead of one per kind).
+    Returns the same tuple as predict_and_update_batch, with the tuple of kinds as kind
+    and y split per observation.
+    Args:
+      t                 (float): Time of the observations
+      kinds         (list, [n]): Types of the observations
+      z             (list, [n]): Measurements, z[i] of dim_z of kinds[i]
+      R             (list, [n]): Measurement noise, R[i] of [dim_z, dim_z]
+      extra_args    (list, [n]): Values used in H computations
+    """
+    kinds = tuple(kinds)
+    if extra_args is None:
+      extra_args = [[] for _ in kinds]
+    assert len(kinds) == len(z) == len(R) == len(extra_args)
+    # the stacked update reads z and extra_args back to back, a wrong size shifts every later observation
+    for kind, z_k, ea in zip(kinds, z, extra_args, strict=True):
+      if kind in self.stacked_dims:
+        dim_z, ea_dim = self.stacked_dims[kind]
+        if np.size(z_k) != dim_z:
+          raise ValueError(f"observation kind {kind} has {dim_z} values, got {np.size(z_k)}")
+        if np.size(ea) != ea_dim:
+          raise ValueError(f"observation kind {kind} takes {ea_dim} extra args, got {np.size(ea)}")
+
+    rewound = self._rewind_for(t)
+    if rewound is None:
+      return None
+
+    ret = self._predict_and_update_stacked(t, kinds, z, R, extra_args, augment)
+    self._fast_forward(rewound)
+    return ret
+
+  def _predict_and_update_stacked(self, t, kinds, z, R, extra_args, augment=False):
+    # initialize time
+    if self.filter_time is None:
+      self.filter_time = t
+
+    # predict
+    dt = t - self.filter_time
+    assert dt >= 0
+    self.x, self.P = self._predict(self.x, self.P, dt)
+    self.filter_time = t
+    xk_km1, Pk_km1 = np.copy(self.x).flatten(), np.copy(self.P)
+
+    z_i = [np.array(z_k, dtype=np.float64).flatten() for z_k in z]
+    if self._update_stacked is not None and not any(kind in self.feature_track_kinds for kind in kinds):
+      # block diagonal R, observations of different kinds are independent
+      dims = [len(z_k) for z_k in z_i]
+      offsets = np.cumsum([0] + dims)
+      R_s = np.zeros((offsets[-1], offsets[-1]), dtype=np.float64)
+      for i, R_k in enumerate(R):
+        R_s[offsets[i]:offsets[i + 1], offsets[i]:offsets[i + 1]] = R_k
+      extra_args_s = np.concatenate([np.array(ea, dtype=np.float64).flatten() for ea in extra_args] + [np.zeros(1)])
+
+      self.x, self.P, y_s = self._update_stacked(self.x, self.P, kinds, np.concatenate(z_i), R_s, extra_args_s)
+      self.normalize_quaternions()
+      y = np.split(y_s, offsets[1:-1])
+    else:
+      # null space projected kinds can't be stacked, update one by one
+      y = []
+      for kind, z_k, R_k, ea in zip(kinds, z_i, R, extra_args, strict=True):
+        R_k = np.array(R_k, dtype=np.float64, order='F')
+        ea = np.array(ea, dtype=np.float64, order='F')
+        self.x, self.P, y_k = self._update(self.x, self.P, kind, z_k, R_k, extra_args=ea)
+        self.normalize_quaternions()
+        y.append(y_k)
+    xk_k, Pk_k = np.copy(self.x).flatten(), np.copy(self.P)
+
+    if augment:
+      self.augment()
+
+    # checkpoint
+    self.checkpoint((t, kinds, z, R, extra_args))
+
+    return xk_km1, xk_k, Pk_km1, Pk_k, t, kinds, y, z, extra_args
+
   def _predict_and_update_batch(self, t, kind, z, R, extra_args, augment=False):
     """The main kalman filter function
     Predicts the state and then updates a batch of observations
@@ -0,0 +1,283 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <eigen3/Eigen/Dense>
+
+#include "ekf.h"
+#include "ekf_load.h"
+#include "rewind_tracker.h"
+
+namespace EKFS {
+
+typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> MatrixXdr;
+
+// EKFSym with the state and error state sizes known at compile time, e.g. from the
+// generated live_kf_constants.h. State, covariance, observations and the rewind
+// history are fixed-size Eigen types and the rewind history is a circular arena
+// allocated once in the constructor, so predict, update and rewind don't touch the
+// heap. Single measurement observations of up to MAX_ZDIM values and MAX_EXTRA_ARGS
+// extra args are supported, without MSCKF augmentation.
+//
+// The state and covariance are only snapshotted every rewind_checkpoint_interval
+// observations, a late observation replays from the nearest snapshot before it.
+// REWIND_LEN defaults to EKFSym's REWIND_TO_KEEP.
+template <int DIM, int EDIM, int MAX_ZDIM = 4, int MAX_EXTRA_ARGS = 4, int REWIND_LEN = 512>
+class EKFSymFixed {
+public:
+  typedef Eigen::Matrix<double, DIM, 1> StateVector;
+  typedef Eigen::Matrix<double, EDIM, EDIM, Eigen::RowMajor> CovMatrix;
+  typedef Eigen::Matrix<double, MAX_ZDIM, 1> ZVector;
+
+  struct Observation {
+    double t;
+    int kind;
+    int dim_z;
+    int n_extra_args;
+    ZVector z;
+    std::array<double, MAX_ZDIM * MAX_ZDIM> R;  // dim_z x dim_z, row major
+    std::array<double, MAX_EXTRA_ARGS> extra_args;
+  };
+
+  struct Estimate {
+    StateVector xk1;
+    StateVector xk;
+    CovMatrix Pk1;
+    CovMatrix Pk;
+    double t;
+    int kind;
+    int dim_z;
+    ZVector y;
+  };
+
+  EKFSymFixed(std::string name, Eigen::Map<MatrixXdr> Q, Eigen::Map<Eigen::VectorXd> x_initial, Eigen::Map<MatrixXdr> P_initial,
+              std::vector<int> quaternion_idxs, std::vector<std::string> global_vars, double max_rewind_age,
+              int rewind_checkpoint_interval = 1) {
+    this->ekf = ekf_lookup(name);
+    assert(this->ekf);
+    assert(x_initial.rows() == DIM && P_initial.rows() == EDIM && P_initial.cols() == EDIM);
+    assert(rewind_checkpoint_interval >= 1);
+
+    this->Q = Q;
+    this->quaternion_idxs = quaternion_idxs;
+    this->global_vars = global_vars;
+    this->max_rewind_age = max_rewind_age;
+    this->checkpoint_interval = rewind_checkpoint_interval;
+
+    this->rewind_buf = std::make_unique<std::array<Checkpoint, REWIND_LEN>>();
+    this->replay_buf = std::make_unique<std::array<Observation, REWIND_LEN>>();
+    this->init_state(x_initial, P_initial, NAN);
+  }
+
+  void init_state(const Eigen::Ref<const Eigen::VectorXd> &state, const Eigen::Ref<const MatrixXdr> &covs, double filter_time) {
+    this->x = state;
+    this->P = covs;
+    this->filter_time = filter_time;
+    this->reset_rewind();
+  }
+
+  const StateVector &state() const { return this->x; }
+  const CovMatrix &covs() const { return this->P; }
+  void set_filter_time(double t) { this->filter_time = t; }
+  double get_filter_time() const { return this->filter_time; }
+  void set_global(std::string global_var, double val) { this->ekf->sets.at(global_var)(val); }
+  const RewindStats &get_rewind_stats() const { return this->rewind_stats; }
+  void reset_rewind_stats() { this->rewind_stats = RewindStats(); }
+
+  void reset_rewind() {
+    this->rewind_start = 0;
+    this->rewind_size = 0;
+    this->since_snapshot = this->checkpoint_interval;  // snapshot the next observation
+  }
+
+  void predict(double t) {
+    // initialize time
+    if (std::isnan(this->filter_time)) {
+      this->filter_time = t;
+    }
+
+    // predict
+    double dt = t - this->filter_time;
+    assert(dt >= 0.0);
+
+    this->ekf->predict(this->x.data(), this->P.data(), this->Q.data(), dt);
+    this->normalize_quaternions();
+    this->filter_time = t;
+  }
+
+  // returns nullptr if the observation is too old to rewind to, the estimate is
+  // owned by the filter and valid until the next call. R should be row major,
+  // anything else is copied by Eigen::Ref
+  const Estimate *predict_and_update(double t, int kind, const Eigen::Ref<const Eigen::VectorXd> &z,
+                                     const Eigen::Ref<const MatrixXdr> &R, const std::vector<double> &extra_args = {}) {
+    assert(z.rows() <= MAX_ZDIM && R.rows() == z.rows() && R.cols() == z.rows());
+    assert((int)extra_args.size() <= MAX_EXTRA_ARGS);
+
+    Observation obs;
+    obs.t = t;
+    obs.kind = kind;
+    obs.dim_z = z.rows();
+    obs.n_extra_args = extra_args.size();
+    obs.z.head(obs.dim_z) = z;
+    Eigen::Map<MatrixXdr>(obs.R.data(), obs.dim_z, obs.dim_z) = R;
+    std::copy(extra_args.begin(), extra_args.end(), obs.extra_args.begin());
+
+    // rewind, replaying the observations between the snapshot and t right away
+    int n_before = 0, n_rewound = 0;
+    if (!std::isnan(this->filter_time) && t < this->filter_time) {
+      if (this->rewind_size == 0 || t < this->checkpoint_at(this->rewind_size - 1).t - this->max_rewind_age || this->snapshot_idx(t) < 0) {
+        this->rewind_stats.dropped++;
+        return nullptr;
+      }
+      n_rewound = this->rewind(t, n_before);
+    }
+    for (int i = 0; i < n_before; i++) {
+      this->predict_and_update(this->replay_buf->at(i), this->replay_estimate);
+    }
+
+    this->predict_and_update(obs, this->estimate);
+
+    // optional fast forward
+    for (int i = n_before; i < n_rewound; i++) {
+      this->predict_and_update(this->replay_buf->at(i), this->replay_estimate);
+    }
+
+    return &this->estimate;
+  }
+
+private:
+  struct Checkpoint {
+    double t;
+    bool has_state;  // x and P are only valid for snapshots
+    StateVector x;
+    CovMatrix P;
+    Observation obs;
+  };
+
+  Checkpoint &checkpoint_at(int i) {
+    return this->rewind_buf->at((this->rewind_start + i) % REWIND_LEN);
+  }
+
+  void normalize_quaternions() {
+    for (int idx : this->quaternion_idxs) {
+      this->x.template segment<4>(idx).normalize();
+    }
+  }
+
+  // index of the last snapshot taken at or before t, -1 if there is none
+  int snapshot_idx(double t) {
+    int i = this->rewind_size - 1;
+    while (i >= 0 && (this->checkpoint_at(i).t > t || !this->checkpoint_at(i).has_state)) {
+      i--;
+    }
+    return i;
+  }
+
+  // restores the nearest snapshot before t and copies the observations after it to
+  // replay_buf, the first n_before of them are at or before t. Returns the number
+  // of observations in replay_buf (they are overwritten when replayed)
+  int rewind(double t, int &n_before) {
+    int snap = this->snapshot_idx(t);
+    assert(snap >= 0);
+
+    int n_rewound = this->rewind_size - snap - 1;
+    n_before = 0;
+    for (int i = 0; i < n_rewound; i++) {
+      const Checkpoint &c = this->checkpoint_at(snap + 1 + i);
+      this->replay_buf->at(i) = c.obs;
+      n_before += c.t <= t;
+    }
+
+    Checkpoint &last = this->checkpoint_at(snap);
+    this->filter_time = last.t;
+    this->x = last.x;
+    this->P = last.P;
+    this->rewind_size = snap + 1;
+    this->since_snapshot = 0;
+
+    this->rewind_stats.rewinds++;
+    this->rewind_stats.replayed += n_rewound;
+    this->rewind_stats.last_depth = n_rewound;
+    this->rewind_stats.max_depth = std::max(this->rewind_stats.max_depth, n_rewound);
+    return n_rewound;
+  }
+
+  void checkpoint(const Observation &obs) {
+    // push to rewinder, dropping the oldest entries when full. Nothing before the oldest
+    // snapshot can be rewound to, so entries are dropped up to the next snapshot and the
+    // oldest entry kept always has one
+    if (this->rewind_size == REWIND_LEN) {
+      do {
+        this->rewind_start = (this->rewind_start + 1) % REWIND_LEN;
+        this->rewind_size--;
+      } while (this->rewind_size > 0 && !this->checkpoint_at(0).has_state);
+    }
+    Checkpoint &c = this->checkpoint_at(this->rewind_size++);
+    c.t = this->filter_time;
+    c.obs = obs;
+
+    // the state is only snapshotted every checkpoint_interval observations
+    c.has_state = ++this->since_snapshot >= this->checkpoint_interval;
+    if (c.has_state) {
+      c.x = this->x;
+      c.P = this->P;
+      this->since_snapshot = 0;
+    }
+  }
+
+  void predict_and_update(const Observation &obs, Estimate &res) {
+    this->predict(obs.t);
+
+    res.t = obs.t;
+    res.kind = obs.kind;
+    res.dim_z = obs.dim_z;
+    res.xk1 = this->x;
+    res.Pk1 = this->P;
+
+    // update state, the generated update writes y into z and takes non-const R and extra args
+    ZVector z = obs.z;
+    std::array<double, MAX_ZDIM * MAX_ZDIM> R = obs.R;
+    std::array<double, MAX_EXTRA_ARGS> extra_args = obs.extra_args;
+    this->ekf->updates.at(obs.kind)(this->x.data(), this->P.data(), z.data(), R.data(), extra_args.data());
+    this->normalize_quaternions();
+
+    res.y = z;
+    res.xk = this->x;
+    res.Pk = this->P;
+
+    this->checkpoint(obs);
+  }
+
+  const EKF *ekf = NULL;
+
+  CovMatrix Q;
+  std::vector<int> quaternion_idxs;
+  std::vector<std::string> global_vars;
+  double max_rewind_age;
+  int checkpoint_interval;
+
+  StateVector x;
+  CovMatrix P;
+  double filter_time;
+
+  // circular rewind history and scratch space for replaying it, allocated once
+  std::unique_ptr<std::array<Checkpoint, REWIND_LEN>> rewind_buf;
+  std::unique_ptr<std::array<Observation, REWIND_LEN>> replay_buf;
+  int rewind_start = 0;
+  int rewind_size = 0;
+  int since_snapshot = 0;
+  RewindStats rewind_stats;
+
+  Estimate estimate;
+  Estimate replay_estimate;
+};
+
+}  // namespace EKFS
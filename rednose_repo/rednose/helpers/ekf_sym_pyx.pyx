@@ -4,13 +4,18 @@
 
 cimport cython
 
+from libc.stdint cimport uint64_t
+from libc.string cimport memcpy
 from libcpp.string cimport string
+from libcpp.unordered_map cimport unordered_map
 from libcpp.vector cimport vector
 from libcpp cimport bool
 cimport numpy as np
 
 import numpy as np
 
+from rednose.helpers.chi2_lookup import chi2_ppf
+
 
 cdef extern from "<optional>" namespace "std" nogil:
   cdef cppclass optional[T]:
@@ -18,8 +23,17 @@ cdef extern from "<optional>" namespace "std" nogil:
     bool has_value()
     T& value()
 
+ctypedef void (*obs_fun)(double*, double*, double*)
+
+cdef extern from "rednose/helpers/ekf.h":
+  cdef cppclass EKF:
+    void (*H_mod_fun)(double*, double*)
+    unordered_map[int, obs_fun] hs
+    unordered_map[int, obs_fun] Hs
+
 cdef extern from "rednose/helpers/ekf_load.h":
   cdef void ekf_load_and_register(string directory, string name)
+  cdef const EKF* ekf_lookup(const string& ekf_name)
 
 cdef extern from "rednose/helpers/ekf_sym.h" namespace "EKFS":
   cdef cppclass MapVectorXd "Eigen::Map<Eigen::VectorXd>":
@@ -67,6 +81,45 @@ cdef extern from "rednose/helpers/ekf_sym.h" namespace "EKFS":
     optional[Estimate] predict_and_update_batch(double t, int kind, vector[MapVectorXd] z, vector[MapMatrixXdr] z,
         vector[vector[double]] extra_args, bool augment)
 
+cdef extern from "rednose/helpers/ekf_rts.h" namespace "EKFS":
+  ctypedef struct FilterStep:
+    double t
+    const double* xk1
+    const double* xk
+    const double* Pk1
+    const double* Pk
+
+  ctypedef struct Smoothed:
+    double t
+    VectorXd x
+    MatrixXdr P
+
+  cdef cppclass RTSSmoother:
+    RTSSmoother(string name, int dim_x, int dim_err, int dim_main, int dim_main_err, vector[int] quaternion_idxs)
+    void smooth(vector[FilterStep] steps, double* x_out, double* P_out, int chunk_len, int lag, int n_threads,
+        vector[int] segment_starts) nogil
+
+  cdef cppclass RTSStream:
+    RTSStream(const RTSSmoother* smoother, int chunk_len, int lag)
+    void push(const FilterStep& step)
+    void flush()
+    bool pop(Smoothed& out)
+
+cdef extern from "rednose/helpers/rewind_tracker.h" namespace "EKFS":
+  ctypedef struct RewindStats:
+    uint64_t rewinds
+    uint64_t dropped
+    uint64_t replayed
+    int last_depth
+    int max_depth
+
+  # as many observations as EKFSym keeps for rewinding, REWIND_TO_KEEP in ekf_sym.h
+  cdef cppclass RewindTracker "EKFS::RewindTracker<512>":
+    const RewindStats& get_stats()
+    void reset_stats()
+    void reset()
+    void track(double t, double filter_time, bool accepted)
+
 # Functions like `numpy_to_matrix` are not possible, cython requires default
 # constructor for return variable types which aren't available with Eigen::Map
 
@@ -82,8 +135,54 @@ cdef np.ndarray[np.float64_t, ndim=1, mode="c"] vector_to_numpy(VectorXd arr):
   cdef double[:] mem_view = <double[:arr.rows()]>arr.data()
   return np.copy(np.asarray(mem_view, dtype=np.double, order="C"))
 
+@cython.wraparound(False)
+@cython.boundscheck(False)
+cdef void vector_into(VectorXd& arr, double[::1] out):
+  if out.shape[0] != arr.rows():
+    raise ValueError(f"output has {out.shape[0]} rows, expected {arr.rows()}")
+  memcpy(&out[0], arr.data(), arr.rows() * sizeof(double))
+
+@cython.wraparound(False)
+@cython.boundscheck(False)
+cdef void matrix_into(MatrixXdr& arr, double[:, ::1] out):
+  if out.shape[0] != arr.rows() or out.shape[1] != arr.cols():
+    raise ValueError(f"output is {out.shape[0]}x{out.shape[1]}, expected {arr.rows()}x{arr.cols()}")
+  memcpy(&out[0, 0], arr.data(), arr.rows() * arr.cols() * sizeof(double))
+
+cdef FilterStep estimate_step(est, list arrays):
+  # FilterStep pointing into the arrays of an estimate as returned by predict_and_update_batch,
+  # the contiguous copies are appended to arrays and have to be kept alive while it is used
+  cdef FilterStep step
+  cdef np.ndarray[np.float64_t, ndim=1, mode='c'] v
+  cdef np.ndarray[np.float64_t, ndim=2, mode='c'] m
+  step.t = est[4]
+  v = np.ascontiguousarray(est[0], dtype=np.double).reshape(-1)
+  step.xk1 = <double*> v.data
+  arrays.append(v)
+  v = np.ascontiguousarray(est[1], dtype=np.double).reshape(-1)
+  step.xk = <double*> v.data
+  arrays.append(v)
+  m = np.ascontiguousarray(est[2], dtype=np.double)
+  step.Pk1 = <double*> m.data
+  arrays.append(m)
+  m = np.ascontiguousarray(est[3], dtype=np.double)
+  step.Pk = <double*> m.data
+  arrays.append(m)
+  return step
+
 cdef class EKF_sym_pyx:
   cdef EKFSym* ekf
+  # buffers behind the read-only state_view()/covs_view() arrays
+  cdef double[::1] x_buf
+  cdef double[:, ::1] P_buf
+  cdef np.ndarray x_view
+  cdef np.ndarray P_view
+  cdef string name
+  cdef int dim_x, dim_err, dim_main, dim_main_err, N, dim_augment, dim_augment_err
+  cdef list augment_times
+  cdef vector[int] quaternion_idxs
+  # counts the rewinds EKFSym does from the observation times passed to it
+  cdef RewindTracker rewind_tracker
   def __cinit__(self, str gen_dir, str name, np.ndarray[np.float64_t, ndim=2] Q,
       np.ndarray[np.float64_t, ndim=1] x_initial, np.ndarray[np.float64_t, ndim=2] P_initial, int dim_main,
       int dim_main_err, int N=0, int dim_augment=0, int dim_augment_err=0, list maha_test_kinds=[],
@@ -110,6 +209,24 @@ cdef class EKF_sym_pyx:
       max_rewind_age
     )
 
+    self.x_view = np.zeros(x_initial.shape[0], dtype=np.double)
+    self.P_view = np.zeros((P_initial.shape[0], P_initial.shape[1]), dtype=np.double)
+    self.x_buf = self.x_view
+    self.P_buf = self.P_view
+    self.x_view.flags.writeable = False
+    self.P_view.flags.writeable = False
+
+    self.name = name.encode('utf8')
+    self.dim_x = x_initial.shape[0]
+    self.dim_err = P_initial.shape[0]
+    self.dim_main = dim_main
+    self.dim_main_err = dim_main_err
+    self.N = N
+    self.dim_augment = dim_augment
+    self.dim_augment_err = dim_augment_err
+    self.augment_times = [0] * N
+    self.quaternion_idxs = quaternion_idxs
+
   def init_state(self, np.ndarray[np.float64_t, ndim=1] state, np.ndarray[np.float64_t, ndim=2] covs, filter_time):
     cdef np.ndarray[np.float64_t, ndim=1, mode='c'] state_b = np.ascontiguousarray(state, dtype=np.double)
     cdef np.ndarray[np.float64_t, ndim=2, mode='c'] covs_b = np.ascontiguousarray(covs, dtype=np.double)
@@ -118,6 +235,8 @@ cdef class EKF_sym_pyx:
       MapMatrixXdr(<double*> covs_b.data, covs.shape[0], covs.shape[1]),
       np.nan if filter_time is None else filter_time
     )
+    self.augment_times = [0] * self.N
+    self.rewind_tracker.reset()
 
   def state(self):
     cdef np.ndarray res = vector_to_numpy(self.ekf.state())
@@ -126,6 +245,19 @@ cdef class EKF_sym_pyx:
   def covs(self):
     return matrix_to_numpy(self.ekf.covs())
 
+  def state_view(self):
+    """Read-only state, without allocating a new array. The array is owned by the
+    filter and refreshed on every call, copy it to keep a value across calls."""
+    cdef VectorXd x = self.ekf.state()
+    vector_into(x, self.x_buf)
+    return self.x_view
+
+  def covs_view(self):
+    """Read-only covariance, see state_view."""
+    cdef MatrixXdr P = self.ekf.covs()
+    matrix_into(P, self.P_buf)
+    return self.P_view
+
   def set_filter_time(self, double t):
     self.ekf.set_filter_time(t)
 
@@ -137,6 +269,16 @@ cdef class EKF_sym_pyx:
 
   def reset_rewind(self):
     self.ekf.reset_rewind()
+    self.rewind_tracker.reset()
+
+  def reset_rewind_stats(self):
+    self.rewind_tracker.reset_stats()
+
+  def get_rewind_stats(self):
+    """Same counters as EKF_sym.get_rewind_stats. EKFSym doesn't report them, so they
+    are derived from the observation times passed in, replay depth counts the
+    observations after t that EKFSym replays."""
+    return self.rewind_tracker.get_stats()
 
   def predict(self, double t):
     self.ekf.predict(t)
@@ -162,9 +304,14 @@ cdef class EKF_sym_pyx:
         args_map.push_back(a)
       extra_args_map.push_back(args_map)
 
-    cdef optional[Estimate] res = self.ekf.predict_and_update_batch(t, kind, z_map, R_map, extra_args_map, augment)
+    cdef double filter_time = self.ekf.get_filter_time()
+    cdef optional[Estimate] res = self.ekf.predict_and_update_batch(t, kind, z_map, R_map, extra_args_map, False)
+    self.rewind_tracker.track(t, filter_time, res.has_value())
     if not res.has_value():
       return None
+    # EKFSym::augment is not implemented, the wrapper augments after the update instead
+    if augment:
+      self.augment()
 
     cdef VectorXd tmpvec
     return (
@@ -179,17 +326,177 @@ cdef class EKF_sym_pyx:
       extra_args,
     )
 
+  @cython.wraparound(False)
+  @cython.boundscheck(False)
+  def predict_and_update_batch_into(self, double t, int kind, double[:, ::1] z, double[:, :, ::1] R,
+      double[:, ::1] extra_args=None, double[::1] xk1=None, double[::1] xk=None,
+      double[:, ::1] Pk1=None, double[:, ::1] Pk=None, double[:, ::1] y=None, bool augment=False):
+    """Same as predict_and_update_batch without allocating numpy arrays. z [n, dim_z],
+    R [n, dim_z, dim_z] and extra_args [n, n_args] must be C contiguous float64 and are
+    used in place. The estimate is written into xk1, xk, Pk1, Pk and y [n, dim_z],
+    outputs that are None are skipped. Returns False if the observation was too old."""
+    cdef int n = z.shape[0]
+    cdef int i
+    if R.shape[0] != n or R.shape[1] != z.shape[1] or R.shape[2] != z.shape[1]:
+      raise ValueError("R has to be [n, dim_z, dim_z]")
+    if extra_args is not None and extra_args.shape[0] != n:
+      raise ValueError("extra_args has to be [n, n_args]")
+
+    cdef vector[MapVectorXd] z_map
+    cdef vector[MapMatrixXdr] R_map
+    cdef vector[vector[double]] extra_args_map = vector[vector[double]](n)
+    z_map.reserve(n)
+    R_map.reserve(n)
+    for i in range(n):
+      z_map.push_back(MapVectorXd(&z[i, 0], z.shape[1]))
+      R_map.push_back(MapMatrixXdr(&R[i, 0, 0], R.shape[1], R.shape[2]))
+      if extra_args is not None and extra_args.shape[1] > 0:
+        extra_args_map[i].assign(&extra_args[i, 0], &extra_args[i, 0] + extra_args.shape[1])
+
+    cdef double filter_time = self.ekf.get_filter_time()
+    cdef optional[Estimate] res = self.ekf.predict_and_update_batch(t, kind, z_map, R_map, extra_args_map, False)
+    self.rewind_tracker.track(t, filter_time, res.has_value())
+    if not res.has_value():
+      return False
+    if augment:
+      self.augment()
+
+    if xk1 is not None:
+      vector_into(res.value().xk1, xk1)
+    if xk is not None:
+      vector_into(res.value().xk, xk)
+    if Pk1 is not None:
+      matrix_into(res.value().Pk1, Pk1)
+    if Pk is not None:
+      matrix_into(res.value().Pk, Pk)
+    if y is not None:
+      if y.shape[0] != <int>res.value().y.size():
+        raise ValueError(f"y has {y.shape[0]} rows, expected {res.value().y.size()}")
+      for i in range(y.shape[0]):
+        vector_into(res.value().y[i], y[i])
+    return True
+
   def augment(self):
-    raise NotImplementedError()  # TODO
+    """Same as EKF_sym.augment, pushes the first dim_augment states into the augmented
+    states. EKFSym can only be given a new state through init_state, which also clears
+    its rewind buffer, so observations older than the augmentation are dropped."""
+    if self.N == 0:
+      raise ValueError("filter has no augmented states")
+    d1 = self.dim_main
+    d2 = self.dim_main_err
+    d3 = self.dim_augment
+    d4 = self.dim_augment_err
+
+    # push through augmented states
+    x = self.state()
+    x[d1:-d3] = x[d1 + d3:]
+    x[-d3:] = x[:d3]
+
+    # push through augmented covs
+    P_reduced = np.delete(self.covs(), np.s_[d2:d2 + d4], axis=1)
+    P_reduced = np.delete(P_reduced, np.s_[d2:d2 + d4], axis=0)
+    to_mult = np.zeros((self.dim_err, self.dim_err - d4))
+    to_mult[:-d4, :] = np.eye(self.dim_err - d4)
+    to_mult[-d4:, :d4] = np.eye(d4)
+    P = np.ascontiguousarray(to_mult.dot(P_reduced.dot(to_mult.T)))
+
+    cdef np.ndarray[np.float64_t, ndim=1, mode='c'] x_b = x
+    cdef np.ndarray[np.float64_t, ndim=2, mode='c'] P_b = P
+    cdef double filter_time = self.ekf.get_filter_time()
+    self.ekf.init_state(MapVectorXd(<double*> x_b.data, self.dim_x),
+                        MapMatrixXdr(<double*> P_b.data, self.dim_err, self.dim_err), filter_time)
+    self.rewind_tracker.reset()
+    self.augment_times = self.augment_times[1:]
+    self.augment_times.append(filter_time)
 
   def get_augment_times(self):
-    raise NotImplementedError()  # TODO
+    return self.augment_times
+
+  def rts_smooth(self, estimates, norm_quats=False, int chunk_len=0, int lag=0, int n_threads=1, segment_starts=None):
+    """RTS smoothed states [n, dim_x] and covariances [n, dim_err, dim_err] of estimates, as
+    returned by predict_and_update_batch. With norm_quats the quaternions in quaternion_idxs
+    are normalized. chunk_len, lag and n_threads split the backward pass into independent
+    chunks, segment_starts are indices of estimates that start a new independent run of the
+    filter, see RTSSmoother in ekf_rts.h."""
+    cdef int n = len(estimates)
+    cdef np.ndarray[np.float64_t, ndim=2, mode='c'] x_out = np.empty((n, self.dim_x), dtype=np.double)
+    cdef np.ndarray[np.float64_t, ndim=3, mode='c'] P_out = np.empty((n, self.dim_err, self.dim_err), dtype=np.double)
+    if n == 0:
+      return x_out, P_out
+
+    # steps point into these, keep them alive until smoothing is done
+    arrays = []
+    cdef vector[FilterStep] steps
+    steps.reserve(n)
+    for est in estimates:
+      steps.push_back(estimate_step(est, arrays))
+
+    cdef vector[int] starts = segment_starts if segment_starts is not None else []
+    cdef RTSSmoother* smoother = new RTSSmoother(self.name, self.dim_x, self.dim_err, self.dim_main, self.dim_main_err,
+                                                 self.quaternion_idxs if norm_quats else vector[int]())
+    try:
+      with nogil:
+        smoother.smooth(steps, <double*> x_out.data, <double*> P_out.data, chunk_len, lag, n_threads, starts)
+    finally:
+      del smoother
+    return x_out, P_out
+
+  def maha_test(self, x, P, int kind, z, R, extra_args=[], maha_thresh=0.95):
+    """Mahalanobis distance test of z against the state x with covariance P, same as
+    EKF_sym.maha_test. Uses the generated h and H functions of kind."""
+    cdef EKF* ekf = <EKF*> ekf_lookup(self.name)
+    if ekf.hs.count(kind) == 0:
+      raise ValueError(f"no observation function for kind {kind}")
+
+    cdef np.ndarray[np.float64_t, ndim=1, mode='c'] x_b = np.ascontiguousarray(x, dtype=np.double)
+    cdef np.ndarray[np.float64_t, ndim=1, mode='c'] z_b = np.ascontiguousarray(z, dtype=np.double).reshape(-1)
+    cdef np.ndarray[np.float64_t, ndim=1, mode='c'] args_b = np.ascontiguousarray(extra_args, dtype=np.double).reshape(-1)
+    cdef np.ndarray[np.float64_t, ndim=1, mode='c'] h = np.zeros(z_b.shape[0], dtype=np.double)
+    cdef np.ndarray[np.float64_t, ndim=2, mode='c'] H = np.zeros((z_b.shape[0], self.dim_x), dtype=np.double)
+    cdef np.ndarray[np.float64_t, ndim=2, mode='c'] H_mod = np.zeros((self.dim_x, self.dim_err), dtype=np.double)
+    ekf.hs[kind](<double*> x_b.data, <double*> args_b.data, <double*> h.data)
+    ekf.Hs[kind](<double*> x_b.data, <double*> args_b.data, <double*> H.data)
+    ekf.H_mod_fun(<double*> x_b.data, <double*> H_mod.data)
+
+    # y is the "loss", H is taken to the error state
+    y = z_b - h
+    H_err = H.dot(H_mod)
+    maha_dist = y.dot(np.linalg.solve(H_err.dot(P).dot(H_err.T) + R, y))
+    cdef bool passed = maha_dist <= chi2_ppf(maha_thresh, y.shape[0])
+    return passed
 
-  def rts_smooth(self, estimates, norm_quats=False):
-    raise NotImplementedError()  # TODO
+  def __dealloc__(self):
+    del self.ekf
 
-  def maha_test(self, x, P, kind, z, R, extra_args=[], maha_thresh=0.95):
-    raise NotImplementedError()  # TODO
+
+cdef class RTSStream_pyx:
+  """Streaming RTS smoother over the estimates of an EKF_sym_pyx, see RTSStream in
+  ekf_rts.h. Push estimates as returned by predict_and_update_batch in order and pop
+  (t, x, P) once they are smoothed, at most chunk_len + lag estimates are kept."""
+  cdef RTSSmoother* smoother
+  cdef RTSStream* stream
+  def __cinit__(self, EKF_sym_pyx ekf, int chunk_len, int lag=0, bool norm_quats=False):
+    if chunk_len <= 0 or lag < 0:
+      raise ValueError("chunk_len has to be positive and lag not negative")
+    self.smoother = new RTSSmoother(ekf.name, ekf.dim_x, ekf.dim_err, ekf.dim_main, ekf.dim_main_err,
+                                    ekf.quaternion_idxs if norm_quats else vector[int]())
+    self.stream = new RTSStream(self.smoother, chunk_len, lag)
+
+  def push(self, estimate):
+    arrays = []
+    self.stream.push(estimate_step(estimate, arrays))
+
+  def flush(self):
+    """Smooths what is left, call at the end of a segment before pushing the next one."""
+    self.stream.flush()
+
+  def pop(self):
+    """Next smoothed (t, x, P) in order, None if none is ready."""
+    cdef Smoothed out
+    if not self.stream.pop(out):
+      return None
+    return out.t, vector_to_numpy(out.x), matrix_to_numpy(out.P)
 
   def __dealloc__(self):
-    del self.ekf
+    del self.stream
+    del self.smoother
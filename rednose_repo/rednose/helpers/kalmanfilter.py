@@ -49,4 +49,8 @@ class KalmanFilter:
     if R is None:
       R = self.get_R(kind, len(data))
 
-    self.filter.predict_and_update_batch(t, kind, data, R)
+    if len(data) > 0 and hasattr(self.filter, 'predict_and_update_batch_into'):
+      # the estimate isn't used, so don't have it copied out
+      self.filter.predict_and_update_batch_into(t, kind, np.ascontiguousarray(data, dtype=np.float64), np.ascontiguousarray(R, dtype=np.float64))
+    else:
+      self.filter.predict_and_update_batch(t, kind, data, R)
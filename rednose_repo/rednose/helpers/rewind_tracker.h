@@ -0,0 +1,76 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+
+namespace EKFS {
+
+struct RewindStats {
+  uint64_t rewinds = 0;   // late observations that were rewound for
+  uint64_t dropped = 0;   // late observations too old to rewind for
+  uint64_t replayed = 0;  // observations replayed in total
+  int last_depth = 0;     // observations replayed for the last rewind
+  int max_depth = 0;      // most observations replayed for a single rewind
+};
+
+// Counts the rewinds of a filter that doesn't report them itself, like EKFSym, from
+// the observation times passed to it. The times of the last LEN observations, the
+// ones the filter can rewind over, are kept sorted in a ring buffer allocated with
+// the tracker. An observation in order is appended, a late one is inserted after
+// moving the depth times after it, which the filter replays anyway.
+template <int LEN = 512>
+class RewindTracker {
+public:
+  const RewindStats &get_stats() const { return this->stats; }
+  void reset_stats() { this->stats = RewindStats(); }
+
+  void reset() {
+    this->start = 0;
+    this->size = 0;
+  }
+
+  // t is the time of an observation, filter_time the filter time before it and
+  // accepted false if the filter rejected it as too old
+  void track(double t, double filter_time, bool accepted) {
+    if (!accepted) {
+      this->stats.dropped++;
+      return;
+    }
+
+    int depth = 0;
+    while (depth < this->size && this->at(this->size - 1 - depth) > t) {
+      depth++;
+    }
+    if (!std::isnan(filter_time) && t < filter_time) {
+      this->stats.rewinds++;
+      this->stats.replayed += depth;
+      this->stats.last_depth = depth;
+      this->stats.max_depth = std::max(this->stats.max_depth, depth);
+    }
+
+    if (this->size == LEN) {
+      if (depth == LEN) {
+        return;  // older than every kept time, it would be dropped right away
+      }
+      this->start = (this->start + 1) % LEN;
+      this->size--;
+    }
+    for (int i = this->size; i > this->size - depth; i--) {
+      this->at(i) = this->at(i - 1);
+    }
+    this->at(this->size - depth) = t;
+    this->size++;
+  }
+
+private:
+  double &at(int i) { return this->times[(this->start + i) % LEN]; }
+
+  std::array<double, LEN> times;
+  int start = 0;
+  int size = 0;
+  RewindStats stats;
+};
+
+}  // namespace EKFS
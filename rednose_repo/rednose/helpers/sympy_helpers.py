@@ -111,44 +111,48 @@ def quat_matrix_r(p):
                     [p[3],  p[2], -p[1],  p[0]]])
 
 
+def trig_terms(expr):
+  """Returns the sin/cos terms of expr as (symbol, term) pairs.
+
+  Terms are ordered by argument with sin and cos of the same argument next to each other,
+  so they are evaluated once, in one block at the top of the function, and the compiler
+  can merge each pair into a single sincos call.
+  """
+  trig = [e for e in expr.atoms(sp.sin, sp.cos) if not e.args[0].has(sp.sin, sp.cos)]
+  trig_args = sorted({e.args[0] for e in trig}, key=sp.default_sort_key)
+  pairs = []
+  for i, arg in enumerate(trig_args):
+    for func in (sp.sin, sp.cos):
+      if func(arg) in trig:
+        pairs.append((sp.Symbol(f'{func.__name__}_{i}'), func(arg)))
+  return pairs
+
+
 def sympy_into_c(sympy_functions, global_vars=None):
-  from sympy.utilities import codegen
-  routines = []
+  from sympy.printing.c import C99CodePrinter
+  printer = C99CodePrinter()
+  c_header, c_code = [], []
   for name, expr, args in sympy_functions:
-    r = codegen.make_routine(name, expr, language="C99", global_vars=global_vars)
-
-    # argument ordering input to sympy is broken with function with output arguments
-    nargs = []
-
-    # reorder the input arguments
-    for aa in args:
-      if aa is None:
-        nargs.append(codegen.InputArgument(sp.Symbol('unused'), dimensions=[1, 1]))
-        continue
-      found = False
-      for a in r.arguments:
-        if str(aa.name) == str(a.name):
-          nargs.append(a)
-          found = True
-          break
-      if not found:
-        # [1,1] is a hack for Matrices
-        nargs.append(codegen.InputArgument(aa, dimensions=[1, 1]))
-
-    # add the output arguments
-    for a in r.arguments:
-      if type(a) == codegen.OutputArgument:
-        nargs.append(a)
-
-    # assert len(r.arguments) == len(args)+1
-    r.arguments = nargs
-
-    # add routine to list
-    routines.append(r)
-
-  [(_, c_code), (_, c_header)] = codegen.get_code_generator('C', 'ekf', 'C99').write(routines, "ekf")
-  c_header = '\n'.join(x for x in c_header.split("\n") if len(x) > 0 and x[0] != '#')
-
-  c_code = '\n'.join(x for x in c_code.split("\n") if len(x) > 0 and x[0] != '#')
-
-  return c_header, c_code
+    # precomputed trig terms first, then common subexpression elimination on the rest
+    trig = trig_terms(expr)
+    common, (expr,) = sp.cse([expr.xreplace({term: sym for sym, term in trig})], symbols=sp.numbered_symbols('x'))
+
+    # matrices are passed as pointers, None is a placeholder for an unused argument
+    params = []
+    for arg in args:
+      if arg is None:
+        params.append('double *unused')
+      elif isinstance(arg, sp.MatrixSymbol):
+        params.append(f'double *{arg.name}')
+      else:
+        params.append(f'double {arg.name}')
+    params.append('double *out')
+    signature = f"void {name}({', '.join(params)})"
+
+    body = [f'const double {sym} = {printer.doprint(term)};' for sym, term in trig + common]
+    body += printer.doprint(expr, assign_to=sp.MatrixSymbol('out', *expr.shape)).split('\n')
+
+    c_header.append(signature + ';')
+    c_code.append(signature + ' {\n' + ''.join(f'   {line}\n' for line in body) + '}')
+
+  return '\n'.join(c_header), '\n'.join(c_code)
@@ -0,0 +1,138 @@
+// Sparse-aware predict and update. The code generator emits the structural
+// nonzeros of F (F_ROW_PTR/F_COL_IDX, CSR over the main block) and the nonzero
+// columns of every error-state measurement jacobian H * H_mod (H_COLS_<kind>),
+// so products only run over those entries. The dense predict/update above stay
+// as the reference and are still used for null space projected updates.
+
+// out = F_main * in, iterating over the structural nonzeros of F_main only
+template <typename In, typename Out>
+void sparse_F_mul(const EEM &F, const In &in, Out &out) {
+  out.setZero();
+  for (int i = 0; i < MEDIM; i++) {
+    for (int n = F_ROW_PTR[i]; n < F_ROW_PTR[i + 1]; n++) {
+      out.row(i) += F(i, F_COL_IDX[n]) * in.row(F_COL_IDX[n]);
+    }
+  }
+}
+
+void predict_sparse(double *in_x, double *in_P, double *in_Q, double dt) {
+  typedef Eigen::Matrix<double, MEDIM, MEDIM, Eigen::RowMajor> RRM;
+  typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> XXM;
+
+  double nx[DIM] = {0};
+  double in_F[EDIM*EDIM] = {0};
+
+  // functions from sympy
+  f_fun(in_x, dt, nx);
+  F_fun(in_x, dt, in_F);
+
+  EEM F(in_F);
+  EEM P(in_P);
+  EEM Q(in_Q);
+
+  // F_main * P_main * F_main^T as two sparse products: (F_main * (F_main * P_main)^T)^T
+  RRM FP, FPFt;
+  sparse_F_mul(F, P.topLeftCorner(MEDIM, MEDIM), FP);
+  sparse_F_mul(F, FP.transpose(), FPFt);
+  P.topLeftCorner(MEDIM, MEDIM) = FPFt.transpose();
+
+  if (EDIM > MEDIM) {
+    XXM FP_right(MEDIM, EDIM - MEDIM), FP_bottom(MEDIM, EDIM - MEDIM);
+    sparse_F_mul(F, P.topRightCorner(MEDIM, EDIM - MEDIM), FP_right);
+    sparse_F_mul(F, P.bottomLeftCorner(EDIM - MEDIM, MEDIM).transpose(), FP_bottom);
+    P.topRightCorner(MEDIM, EDIM - MEDIM) = FP_right;
+    P.bottomLeftCorner(EDIM - MEDIM, MEDIM) = FP_bottom.transpose();
+  }
+
+  P = P + dt*Q;
+
+  // copy out state
+  memcpy(in_x, nx, DIM * sizeof(double));
+  memcpy(in_P, P.data(), EDIM * EDIM * sizeof(double));
+}
+
+// Same result as update<ZDIM, EADIM, MAHA_TEST> without null space projection,
+// but only the NCOLS nonzero columns of H_err (listed in cols) are used, and the
+// symmetric innovation covariance is factored once with LDLT instead of full pivot LU.
+template <int ZDIM, int NCOLS, bool MAHA_TEST>
+void update_sparse(double *in_x, double *in_P, Hfun h_fun, Hfun H_fun, double *in_z, double *in_R, double *in_ea, double MAHA_THRESHOLD, const int *cols) {
+  typedef Eigen::Matrix<double, ZDIM, ZDIM, Eigen::RowMajor> ZZM;
+  typedef Eigen::Matrix<double, ZDIM, DIM, Eigen::RowMajor> ZDM;
+  // column major, a row major matrix can't have a single column
+  typedef Eigen::Matrix<double, ZDIM, ZDIM> SM;
+  typedef Eigen::Matrix<double, ZDIM, NCOLS> ZCM;
+  typedef Eigen::Matrix<double, EDIM, NCOLS> ECM;
+  typedef Eigen::Matrix<double, NCOLS, ZDIM> CZM;
+  typedef Eigen::Matrix<double, EDIM, ZDIM> EZM;
+  typedef Eigen::Matrix<double, ZDIM, EDIM> ZEM;
+
+  double in_hx[ZDIM] = {0};
+  double in_H[ZDIM * DIM] = {0};
+  double in_H_mod[EDIM * DIM] = {0};
+  double delta_x[EDIM] = {0};
+  double x_new[DIM] = {0};
+
+  // state x, P
+  Eigen::Matrix<double, ZDIM, 1> z(in_z);
+  EEM P(in_P);
+  ZZM R(in_R);
+
+  // functions from sympy
+  h_fun(in_x, in_ea, in_hx);
+  H_fun(in_x, in_ea, in_H);
+  ZDM H(in_H);
+  H_mod_fun(in_x, in_H_mod);
+  DEM H_mod(in_H_mod);
+
+  // get y (y = z - hx)
+  Eigen::Matrix<double, ZDIM, 1> y(in_hx); y = z - y;
+
+  // nonzero columns of H_err = H * H_mod and the matching columns of P
+  ZCM H_err;
+  ECM P_cols;
+  for (int j = 0; j < NCOLS; j++) {
+    H_err.col(j) = H * H_mod.col(cols[j]);
+    P_cols.col(j) = P.col(cols[j]);
+  }
+
+  // P * H_err^T and S = H_err * P * H_err^T + R
+  EZM PHt = P_cols * H_err.transpose();
+  CZM PHt_cols;
+  for (int j = 0; j < NCOLS; j++) {
+    PHt_cols.row(j) = PHt.row(cols[j]);
+  }
+  SM S = H_err * PHt_cols + R;
+  Eigen::LDLT<SM> S_ldlt(S);
+
+  // Do mahalobis distance test
+  if (MAHA_TEST){
+    double maha_dist = y.dot(S_ldlt.solve(y));
+    if (maha_dist > MAHA_THRESHOLD){
+      R = 1.0e16 * R;
+      S = H_err * PHt_cols + R;
+      S_ldlt.compute(S);
+    }
+  }
+
+  // kalman gain, K^T = S^-1 * (P * H_err^T)^T
+  ZEM KT = S_ldlt.solve(PHt.transpose());
+
+  // update state by injecting dx
+  Eigen::Matrix<double, EDIM, 1> dx(delta_x);
+  dx = KT.transpose() * y;
+  memcpy(delta_x, dx.data(), EDIM * sizeof(double));
+  err_fun(in_x, delta_x, x_new);
+  Eigen::Matrix<double, DIM, 1> x(x_new);
+
+  // update cov, Joseph form (I - KH) P (I - KH)^T + K R K^T expanded to
+  // P - K (PH^T)^T - PH^T K^T + K S K^T so no EDIM x EDIM x EDIM product is needed
+  EEM KHP = KT.transpose() * PHt.transpose();
+  P = P - KHP - KHP.transpose() + (KT.transpose() * S) * KT;
+  // the expansion is only exact for a symmetric P, don't let rounding errors build up
+  P = 0.5 * (P + P.transpose()).eval();
+
+  // copy out state
+  memcpy(in_x, x.data(), DIM * sizeof(double));
+  memcpy(in_P, P.data(), EDIM * EDIM * sizeof(double));
+  memcpy(in_z, y.data(), ZDIM * sizeof(double));
+}
@@ -0,0 +1,117 @@
+// Stacked update: observations of different kinds taken at the same time are
+// concatenated into one innovation, so P is updated and S factored once instead
+// of once per observation. The generator emits a StackedObs table with every
+// kind that can be stacked (all kinds without null space projection).
+
+struct StackedObs {
+  int kind;
+  int dim;     // dimension of z
+  int ea_dim;  // number of extra args, 0 if the kind takes none
+  Hfun h_fun;
+  Hfun H_fun;
+  bool maha_test;
+  double maha_thresh;
+};
+
+// Dimension of z and number of extra args of kind in a stacked update, so callers can
+// check the vectors they concatenate. Returns 0 if kind can't be stacked.
+int stacked_dims(int kind, int *dim, int *ea_dim, const StackedObs *table, int table_size) {
+  for (int j = 0; j < table_size; j++) {
+    if (table[j].kind == kind) {
+      *dim = table[j].dim;
+      *ea_dim = table[j].ea_dim;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// z and ea are the per observation vectors concatenated in the order of kinds,
+// R is the full stacked measurement covariance (row major), usually block diagonal.
+// On return z holds the stacked innovation. Returns the index of the first kind
+// that is not in the table, and updates nothing, or -1 on success.
+int update_stacked(double *in_x, double *in_P, int n, const int *kinds, double *in_z, double *in_R, double *in_ea,
+                    const StackedObs *table, int table_size) {
+  typedef Eigen::Matrix<double, Eigen::Dynamic, EDIM, Eigen::RowMajor> XEM;
+  typedef Eigen::Matrix<double, Eigen::Dynamic, DIM, Eigen::RowMajor> XDM;
+  typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> XXM;
+  typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic> SM;
+  typedef Eigen::Matrix<double, Eigen::Dynamic, 1> X1M;
+
+  std::vector<const StackedObs *> obs(n);
+  int z_dim = 0;
+  for (int i = 0; i < n; i++) {
+    obs[i] = NULL;
+    for (int j = 0; j < table_size; j++) {
+      if (table[j].kind == kinds[i]) obs[i] = &table[j];
+    }
+    if (obs[i] == NULL) return i;
+    z_dim += obs[i]->dim;
+  }
+
+  double in_H_mod[EDIM * DIM] = {0};
+  double delta_x[EDIM] = {0};
+  double x_new[DIM] = {0};
+
+  // state x, P
+  EEM P(in_P);
+  Eigen::Map<X1M> z(in_z, z_dim);
+  XXM R = Eigen::Map<XXM>(in_R, z_dim, z_dim);
+
+  // stack y (y = z - hx) and H
+  X1M y(z_dim);
+  XDM H(z_dim, DIM);
+  for (int i = 0, z_off = 0, ea_off = 0; i < n; z_off += obs[i]->dim, ea_off += obs[i]->ea_dim, i++) {
+    obs[i]->h_fun(in_x, in_ea + ea_off, y.data() + z_off);
+    obs[i]->H_fun(in_x, in_ea + ea_off, H.data() + z_off * DIM);
+  }
+  y = z - y;
+
+  // get modified H
+  H_mod_fun(in_x, in_H_mod);
+  DEM H_mod(in_H_mod);
+  XEM H_err = H * H_mod;
+
+  Eigen::Matrix<double, EDIM, Eigen::Dynamic> PHt = P * H_err.transpose();
+  SM S = H_err * PHt + R;
+
+  // Do mahalobis distance test per observation, on its own block of S
+  bool rejected = false;
+  for (int i = 0, z_off = 0; i < n; z_off += obs[i]->dim, i++) {
+    if (!obs[i]->maha_test) continue;
+    X1M y_i = y.segment(z_off, obs[i]->dim);
+    double maha_dist = y_i.dot(S.block(z_off, z_off, obs[i]->dim, obs[i]->dim).ldlt().solve(y_i));
+    if (maha_dist > obs[i]->maha_thresh) {
+      // scales the diagonal block by 1e16 like update<>, cross terms by 1e8 so R stays positive definite
+      R.middleRows(z_off, obs[i]->dim) *= 1.0e8;
+      R.middleCols(z_off, obs[i]->dim) *= 1.0e8;
+      rejected = true;
+    }
+  }
+  if (rejected) {
+    S = H_err * PHt + R;
+  }
+
+  // kalman gain, K^T = S^-1 * (P * H_err^T)^T
+  Eigen::LDLT<SM> S_ldlt(S);
+  XEM KT = S_ldlt.solve(PHt.transpose());
+
+  // update state by injecting dx
+  Eigen::Matrix<double, EDIM, 1> dx(delta_x);
+  dx = KT.transpose() * y;
+  memcpy(delta_x, dx.data(), EDIM * sizeof(double));
+  err_fun(in_x, delta_x, x_new);
+  Eigen::Matrix<double, DIM, 1> x(x_new);
+
+  // update cov, expanded Joseph form as in update_sparse
+  EEM KHP = KT.transpose() * PHt.transpose();
+  P = P - KHP - KHP.transpose() + (KT.transpose() * S) * KT;
+  // the expansion is only exact for a symmetric P, don't let rounding errors build up
+  P = 0.5 * (P + P.transpose()).eval();
+
+  // copy out state
+  memcpy(in_x, x.data(), DIM * sizeof(double));
+  memcpy(in_P, P.data(), EDIM * EDIM * sizeof(double));
+  z = y;
+  return -1;
+}
@@ -28,7 +28,10 @@ class CompileFilterMethod(BaseRednoseCompileMethod):
     linker_flags = env.get("LINKFLAGS", [])
     if platform.system() == "Darwin":
       linker_flags = ["-undefined", "dynamic_lookup"]
-    lib_target = env.SharedLibrary(f'{output_dir}/{target}', [self.base_cc_deps, objects], LINKFLAGS=linker_flags)
+    # generated code is straight line math, math functions that never set errno can be
+    # inlined and sin/cos of the same argument merged into one sincos call
+    cc_flags = env.get("CCFLAGS", []) + ["-fno-math-errno"]
+    lib_target = env.SharedLibrary(f'{output_dir}/{target}', [self.base_cc_deps, objects], LINKFLAGS=linker_flags, CCFLAGS=cc_flags)
 
     return lib_target
 
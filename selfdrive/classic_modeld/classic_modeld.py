@@ -19,11 +19,12 @@ from openpilot.common.transformations.model import get_warp_matrix
 from openpilot.system import sentry
 from openpilot.selfdrive.car.car_helpers import get_demo_car_params
 from openpilot.selfdrive.controls.lib.desire_helper import DesireHelper
-from openpilot.selfdrive.classic_modeld.runners import ModelRunner, Runtime
+from openpilot.selfdrive.modeld.runners import ModelRunner, Runtime
 from openpilot.selfdrive.classic_modeld.parse_model_outputs import Parser
 from openpilot.selfdrive.classic_modeld.fill_model_msg import fill_model_msg, fill_pose_msg, PublishState
 from openpilot.selfdrive.classic_modeld.constants import ModelConstants
-from openpilot.selfdrive.classic_modeld.models.commonmodel_pyx import ModelFrame, CLContext
+from openpilot.selfdrive.classic_modeld.models.commonmodel_pyx import ModelFrame
+from openpilot.selfdrive.modeld.models.commonmodel_pyx import CLContext
 
 from openpilot.selfdrive.frogpilot.assets.model_manager import DEFAULT_MODEL
 from openpilot.selfdrive.frogpilot.frogpilot_functions import MODELS_PATH
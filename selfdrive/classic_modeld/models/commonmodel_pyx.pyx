@@ -5,26 +5,16 @@ import numpy as np
 cimport numpy as cnp
 from libc.string cimport memcpy
 
-from msgq.visionipc.visionipc cimport cl_mem
-from msgq.visionipc.visionipc_pyx cimport VisionBuf, CLContext as BaseCLContext
-from .commonmodel cimport CL_DEVICE_TYPE_DEFAULT, cl_get_device_id, cl_create_context
+from msgq.visionipc.visionipc_pyx cimport VisionBuf
+from selfdrive.modeld.models.commonmodel_pyx cimport CLContext, CLMem
 from .commonmodel cimport mat3, sigmoid as cppSigmoid, ModelFrame as cppModelFrame
 
+# CLContext and CLMem come from the model core shared with selfdrive/modeld,
+# only the input packing (float model inputs) is specific to this model family
+
 def sigmoid(x):
   return cppSigmoid(x)
 
-cdef class CLContext(BaseCLContext):
-  def __cinit__(self):
-    self.device_id = cl_get_device_id(CL_DEVICE_TYPE_DEFAULT)
-    self.context = cl_create_context(self.device_id)
-
-cdef class CLMem:
-  @staticmethod
-  cdef create(void * cmem):
-    mem = CLMem()
-    mem.mem = <cl_mem*> cmem
-    return mem
-
 cdef class ModelFrame:
   cdef cppModelFrame * frame
 
@@ -3,12 +3,13 @@
 #include <cassert>
 #include <cstring>
 
+#include "common/clcache.h"
 #include "common/clutil.h"
 
 void transform_init(Transform* s, cl_context ctx, cl_device_id device_id) {
   memset(s, 0, sizeof(*s));
 
-  cl_program prg = cl_program_from_file(ctx, device_id, TRANSFORM_PATH, "");
+  cl_program prg = cl_cached_program_from_file(ctx, device_id, TRANSFORM_PATH, "");
   s->krnl = CL_CHECK_ERR(clCreateKernel(prg, "warpPerspective", &err));
   // done with this
   CL_CHECK(clReleaseProgram(prg));
@@ -0,0 +1,571 @@
+// Offline replay of the live (locationd) and car (paramsd) filters over rlogs.
+// Every rlog is mmap'd and read in place, its events are fed to the filter in
+// logMonoTime order and the filtered state is written to a csv per log. Logs are
+// replayed in parallel, one process per log since the generated filters keep
+// their globals (e.g. the car parameters) in process wide variables.
+//
+//   ekf_replay [-f live|car] [-j jobs] [-r rate] [-o out_dir] rlog...
+//
+// rlogs have to be decompressed (bunzip2/zstd -d) first.
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <eigen3/Eigen/Dense>
+#include <capnp/serialize.h>
+
+#include "cereal/gen/cpp/log.capnp.h"
+#include "common/transformations/coordinates.hpp"
+#include "common/transformations/orientation.hpp"
+#include "rednose/helpers/ekf_sym.h"
+#include "rednose/helpers/ekf_sym_fixed.h"
+#include "selfdrive/locationd/models/generated/car_kf_constants.h"
+#include "selfdrive/locationd/models/generated/live_kf_constants.h"
+
+using namespace EKFS;
+using namespace Eigen;
+
+// models/constants.py ObservationKind, the kinds the two filters are observed with
+enum ObservationKind {
+  PHONE_GYRO = 4,
+  NO_ROT = 9,
+  PHONE_ACCEL = 10,
+  ECEF_POS = 12,
+  CAMERA_ODO_TRANSLATION = 13,
+  CAMERA_ODO_ROTATION = 14,
+  NO_ACCEL = 33,
+  ECEF_VEL = 35,
+  ROAD_FRAME_YAW_RATE = 25,
+  STEER_ANGLE = 26,
+  ANGLE_OFFSET_FAST = 27,
+  STIFFNESS = 28,
+  STEER_RATIO = 29,
+  ROAD_FRAME_X_SPEED = 30,
+  ROAD_ROLL = 31,
+};
+
+// locationd
+const double ACCEL_SANITY_CHECK = 100.0;  // m/s^2
+const double ROTATION_SANITY_CHECK = 10.0;  // rad/s
+const double TRANS_SANITY_CHECK = 200.0;  // m/s
+const double CALIB_RPY_SANITY_CHECK = 0.5;  // rad (+- 30 deg)
+const double ALTITUDE_SANITY_CHECK = 10000;  // m
+const double MIN_STD_SANITY_CHECK = 1e-5;  // m or rad
+const double SANE_GPS_UNCERTAINTY = 1500.0;  // m
+const double SENSOR_TIME_SANITY_CHECK = 0.1;  // s
+const double LIVE_MAX_REWIND_AGE = 0.8;  // s
+
+// paramsd
+const double DT_MDL = 0.05;
+const double ROLL_MAX_DELTA = 20.0 * M_PI / 180.0 * DT_MDL;
+const double ROLL_MIN = -10.0 * M_PI / 180.0, ROLL_MAX = 10.0 * M_PI / 180.0;
+const double ROLL_STD_MAX = 1.5 * M_PI / 180.0;
+const double MIN_ACTIVE_SPEED = 1.0;  // m/s
+
+static MatrixXdr obs_noise_R(const std::unordered_map<int, MatrixXdr> &obs_noise_diag, int kind) {
+  return obs_noise_diag.at(kind).col(0).asDiagonal();
+}
+
+static VectorXd floatlist2vector(const capnp::List<float, capnp::Kind::PRIMITIVE>::Reader &floatlist) {
+  VectorXd res(floatlist.size());
+  for (int i = 0; i < floatlist.size(); i++) {
+    res[i] = floatlist[i];
+  }
+  return res;
+}
+
+// variances of a vector with independent stds std after rotating it by rot
+static VectorXd rotate_var(const Matrix3d &rot, const VectorXd &std) {
+  Matrix3d cov = std.array().square().matrix().asDiagonal();
+  return (rot * cov * rot.transpose()).diagonal();
+}
+
+
+// A log mapped into memory, events are read in place
+class Rlog {
+public:
+  Rlog() {
+    // long logs go way past the default traversal limit
+    this->options.traversalLimitInWords = UINT64_MAX;
+  }
+
+  ~Rlog() {
+    if (this->data != MAP_FAILED) {
+      munmap(this->data, this->size);
+    }
+  }
+
+  bool open(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      this->size = st.st_size;
+      this->data = mmap(NULL, this->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (this->data == MAP_FAILED) {
+      return false;
+    }
+    madvise(this->data, this->size, MADV_SEQUENTIAL);
+
+    // index the events, rlogs are mostly but not strictly ordered by logMonoTime
+    kj::ArrayPtr<const capnp::word> words((const capnp::word *)this->data, this->size / sizeof(capnp::word));
+    try {
+      while (words.size() > 0) {
+        capnp::FlatArrayMessageReader reader(words, this->options);
+        this->events.push_back({ reader.getRoot<cereal::Event>().getLogMonoTime(), words.begin() });
+        words = kj::arrayPtr(reader.getEnd(), words.end());
+      }
+    } catch (const kj::Exception &e) {
+      fprintf(stderr, "%s: stopping at a corrupt event after %zu events: %s\n", path.c_str(), this->events.size(), e.getDescription().cStr());
+    }
+    std::stable_sort(this->events.begin(), this->events.end(), [](const Entry &a, const Entry &b) { return a.mono_time < b.mono_time; });
+    return true;
+  }
+
+  template <typename Fn>
+  void for_each(const Fn &fn) const {
+    const capnp::word *end = (const capnp::word *)this->data + this->size / sizeof(capnp::word);
+    for (const Entry &entry : this->events) {
+      capnp::FlatArrayMessageReader reader(kj::arrayPtr(entry.start, end), this->options);
+      fn(reader.getRoot<cereal::Event>());
+    }
+  }
+
+  size_t n_events() const { return this->events.size(); }
+
+private:
+  struct Entry {
+    uint64_t mono_time;
+    const capnp::word *start;
+  };
+
+  capnp::ReaderOptions options;
+  void *data = MAP_FAILED;
+  size_t size = 0;
+  std::vector<Entry> events;
+};
+
+
+// the live filter runs allocation free, all its observations are 3 dimensional
+typedef EKFSymFixed<LIVE_DIM_STATE, LIVE_DIM_STATE_ERR, 3> LiveFilter;
+
+static void predict_and_update(EKFSym &kf, double t, int kind, VectorXd &z, MatrixXdr &R) {
+  std::vector<Map<VectorXd>> zs = { Map<VectorXd>(z.data(), z.rows()) };
+  std::vector<Map<MatrixXdr>> Rs = { Map<MatrixXdr>(R.data(), R.rows(), R.cols()) };
+  kf.predict_and_update_batch(t, kind, zs, Rs, { {} }, false);
+}
+
+static void predict_and_update(LiveFilter &kf, double t, int kind, VectorXd &z, MatrixXdr &R) {
+  kf.predict_and_update(t, kind, z, R);
+}
+
+
+class Replayer {
+public:
+  virtual ~Replayer() = default;
+  virtual void handle_event(double t, const cereal::Event::Reader &event) = 0;
+  virtual const char *name() const = 0;
+
+  // filter time, state and stds, nothing before the filter is set up
+  virtual bool get_estimate(double &t, VectorXd &x, VectorXd &std) const = 0;
+};
+
+template <typename Filter>
+class FilterReplayer : public Replayer {
+public:
+  bool get_estimate(double &t, VectorXd &x, VectorXd &std) const override {
+    if (!this->kf || std::isnan(this->kf->get_filter_time())) {
+      return false;
+    }
+    t = this->kf->get_filter_time();
+    x = this->kf->state();
+    std = this->kf->covs().diagonal().array().sqrt();
+    return true;
+  }
+
+protected:
+  void observe(double t, int kind, VectorXd z, MatrixXdr R) {
+    predict_and_update(*this->kf, t, kind, z, R);
+  }
+
+  std::unique_ptr<Filter> kf;
+};
+
+
+// The observations locationd makes from sensors, camera odometry, calibration, car
+// state and gps. GPS fixes are used as ECEF position/velocity, the filter is
+// reset to a fix that is too far off but the gps specific noise models and time
+// offsets of locationd are not modeled.
+class LiveReplayer : public FilterReplayer<LiveFilter> {
+public:
+  LiveReplayer() {
+    VectorXd x = live_initial_x;
+    MatrixXdr P = live_initial_P_diag.asDiagonal();
+    MatrixXdr Q = live_Q_diag.asDiagonal();
+    this->kf = std::make_unique<LiveFilter>("live", Map<MatrixXdr>(Q.data(), Q.rows(), Q.cols()), Map<VectorXd>(x.data(), x.rows()),
+                                            Map<MatrixXdr>(P.data(), P.rows(), P.cols()), std::vector<int>{ STATE_ECEF_ORIENTATION_START },
+                                            std::vector<std::string>(), LIVE_MAX_REWIND_AGE);
+  }
+
+  const char *name() const override { return "live"; }
+
+  void handle_event(double t, const cereal::Event::Reader &event) override {
+    switch (event.which()) {
+      case cereal::Event::ACCELEROMETER:
+        this->handle_sensor(t, event.getAccelerometer());
+        break;
+      case cereal::Event::GYROSCOPE:
+        this->handle_sensor(t, event.getGyroscope());
+        break;
+      case cereal::Event::GPS_LOCATION_EXTERNAL:
+        this->handle_gps(t, event.getGpsLocationExternal(), 10.0);
+        break;
+      case cereal::Event::GPS_LOCATION:
+        this->handle_gps(t, event.getGpsLocation(), 2.0);
+        break;
+      case cereal::Event::CAMERA_ODOMETRY:
+        this->handle_cam_odo(t, event.getCameraOdometry());
+        break;
+      case cereal::Event::LIVE_CALIBRATION:
+        this->handle_live_calib(event.getLiveCalibration());
+        break;
+      case cereal::Event::CAR_STATE:
+        if (event.getCarState().getStandstill()) {
+          this->observe(t, ObservationKind::NO_ROT, Vector3d::Zero(), obs_noise_R(live_obs_noise_diag, ObservationKind::NO_ROT));
+          this->observe(t, ObservationKind::NO_ACCEL, Vector3d::Zero(), obs_noise_R(live_obs_noise_diag, ObservationKind::NO_ACCEL));
+        }
+        break;
+      default:
+        break;
+    }
+  }
+
+private:
+  void handle_sensor(double t, const cereal::SensorEventData::Reader &log) {
+    // ignore empty readings and readings from the secondary imu
+    if (log.getTimestamp() == 0 || log.getSource() == cereal::SensorEventData::SensorSource::BMX055) {
+      return;
+    }
+    double sensor_time = 1e-9 * log.getTimestamp();
+    if (std::abs(t - sensor_time) > SENSOR_TIME_SANITY_CHECK) {
+      return;
+    }
+
+    if (log.isGyroUncalibrated()) {
+      auto v = log.getGyroUncalibrated().getV();
+      Vector3d meas(-v[2], -v[1], -v[0]);
+      if (meas.norm() < ROTATION_SANITY_CHECK) {
+        this->observe(sensor_time, ObservationKind::PHONE_GYRO, meas, obs_noise_R(live_obs_noise_diag, ObservationKind::PHONE_GYRO));
+      }
+    } else if (log.isAcceleration()) {
+      auto v = log.getAcceleration().getV();
+      Vector3d meas(-v[2], -v[1], -v[0]);
+      if (meas.norm() < ACCEL_SANITY_CHECK) {
+        this->observe(sensor_time, ObservationKind::PHONE_ACCEL, meas, obs_noise_R(live_obs_noise_diag, ObservationKind::PHONE_ACCEL));
+      }
+    }
+  }
+
+  void handle_gps(double t, const cereal::GpsLocationData::Reader &log, double gps_std_factor) {
+    bool gps_invalid_flag = (log.getFlags() % 2 == 0);
+    bool gps_unreasonable = (Vector2d(log.getHorizontalAccuracy(), log.getVerticalAccuracy()).norm() >= SANE_GPS_UNCERTAINTY);
+    bool gps_accuracy_insane = ((log.getVerticalAccuracy() <= 0) || (log.getSpeedAccuracy() <= 0) || (log.getBearingAccuracyDeg() <= 0));
+    bool gps_lat_lng_alt_insane = ((std::abs(log.getLatitude()) > 90) || (std::abs(log.getLongitude()) > 180) || (std::abs(log.getAltitude()) > ALTITUDE_SANITY_CHECK));
+    bool gps_vel_insane = (floatlist2vector(log.getVNED()).norm() > TRANS_SANITY_CHECK);
+    if (gps_invalid_flag || gps_unreasonable || gps_accuracy_insane || gps_lat_lng_alt_insane || gps_vel_insane) {
+      return;
+    }
+
+    Geodetic geodetic = { log.getLatitude(), log.getLongitude(), log.getAltitude() };
+    LocalCoord converter(geodetic);
+    ECEF pos = converter.ned2ecef({ 0.0, 0.0, 0.0 });
+    ECEF vel = converter.ned2ecef({ log.getVNED()[0], log.getVNED()[1], log.getVNED()[2] });
+    Vector3d ecef_pos(pos.x, pos.y, pos.z);
+    Vector3d ecef_vel = Vector3d(vel.x, vel.y, vel.z) - ecef_pos;
+    double ecef_pos_std = Vector2d(log.getHorizontalAccuracy(), log.getVerticalAccuracy()).norm();
+    MatrixXdr ecef_pos_R = Vector3d::Constant(std::pow(gps_std_factor * ecef_pos_std, 2)).asDiagonal();
+    MatrixXdr ecef_vel_R = Vector3d::Constant(std::pow(gps_std_factor * log.getSpeedAccuracy(), 2)).asDiagonal();
+
+    VectorXd x = this->kf->state();
+    if (std::isnan(this->kf->get_filter_time()) || (x.segment<STATE_ECEF_POS_LEN>(STATE_ECEF_POS_START) - ecef_pos).norm() > SANE_GPS_UNCERTAINTY) {
+      // (re)start at the fix, facing along the gps bearing
+      Vector3d orientation_ned(0.0, 0.0, log.getBearingDeg() * M_PI / 180.0);
+      Quaterniond q = euler2quat(ecef_euler_from_ned(pos, orientation_ned));
+      x.segment<STATE_ECEF_POS_LEN>(STATE_ECEF_POS_START) = ecef_pos;
+      x.segment<STATE_ECEF_ORIENTATION_LEN>(STATE_ECEF_ORIENTATION_START) << q.w(), q.x(), q.y(), q.z();
+      x.segment<STATE_ECEF_VELOCITY_LEN>(STATE_ECEF_VELOCITY_START) = ecef_vel;
+      MatrixXdr P = live_initial_P_diag.asDiagonal();
+      P.block<STATE_ECEF_POS_ERR_LEN, STATE_ECEF_POS_ERR_LEN>(STATE_ECEF_POS_ERR_START, STATE_ECEF_POS_ERR_START) = ecef_pos_R;
+      P.block<STATE_ECEF_VELOCITY_ERR_LEN, STATE_ECEF_VELOCITY_ERR_LEN>(STATE_ECEF_VELOCITY_ERR_START, STATE_ECEF_VELOCITY_ERR_START) = ecef_vel_R;
+      this->kf->init_state(Map<VectorXd>(x.data(), x.rows()), Map<MatrixXdr>(P.data(), P.rows(), P.cols()), t);
+    }
+
+    this->observe(t, ObservationKind::ECEF_POS, ecef_pos, ecef_pos_R);
+    this->observe(t, ObservationKind::ECEF_VEL, ecef_vel, ecef_vel_R);
+  }
+
+  void handle_cam_odo(double t, const cereal::CameraOdometry::Reader &log) {
+    VectorXd rot_device = this->device_from_calib * floatlist2vector(log.getRot());
+    VectorXd trans_device = this->device_from_calib * floatlist2vector(log.getTrans());
+    if ((rot_device.norm() > ROTATION_SANITY_CHECK) || (trans_device.norm() > TRANS_SANITY_CHECK)) {
+      return;
+    }
+
+    VectorXd rot_calib_std = floatlist2vector(log.getRotStd());
+    VectorXd trans_calib_std = floatlist2vector(log.getTransStd());
+    if ((rot_calib_std.minCoeff() <= MIN_STD_SANITY_CHECK) || (trans_calib_std.minCoeff() <= MIN_STD_SANITY_CHECK) ||
+        (rot_calib_std.norm() > 10 * ROTATION_SANITY_CHECK) || (trans_calib_std.norm() > 10 * TRANS_SANITY_CHECK)) {
+      return;
+    }
+
+    // Multiply by 10 to avoid to high certainty in kalman filter because of temporally correlated noise
+    MatrixXdr rot_device_R = rotate_var(this->device_from_calib, 10.0 * rot_calib_std).asDiagonal();
+    MatrixXdr trans_device_R = rotate_var(this->device_from_calib, 10.0 * trans_calib_std).asDiagonal();
+    this->observe(t, ObservationKind::CAMERA_ODO_ROTATION, rot_device, rot_device_R);
+    this->observe(t, ObservationKind::CAMERA_ODO_TRANSLATION, trans_device, trans_device_R);
+  }
+
+  void handle_live_calib(const cereal::LiveCalibrationData::Reader &log) {
+    if (log.getRpyCalib().size() > 0) {
+      VectorXd calib = floatlist2vector(log.getRpyCalib());
+      if ((calib.minCoeff() < -CALIB_RPY_SANITY_CHECK) || (calib.maxCoeff() > CALIB_RPY_SANITY_CHECK)) {
+        return;
+      }
+      this->device_from_calib = euler2rot(Vector3d(calib[0], calib[1], calib[2]));
+    }
+  }
+
+  Matrix3d device_from_calib = Matrix3d::Identity();
+};
+
+
+// paramsd's ParamsLearner, set up from the carParams in the log with the car's
+// default steer ratio, stiffness factor 1 and no angle offset
+class CarReplayer : public FilterReplayer<EKFSym> {
+public:
+  const char *name() const override { return "car"; }
+
+  void handle_event(double t, const cereal::Event::Reader &event) override {
+    if (event.which() == cereal::Event::CAR_PARAMS) {
+      if (!this->kf) {
+        this->init(event.getCarParams());
+      }
+      return;
+    }
+    if (!this->kf) {
+      return;
+    }
+
+    if (event.which() == cereal::Event::LIVE_LOCATION_KALMAN) {
+      auto msg = event.getLiveLocationKalman();
+      this->yaw_rate = msg.getAngularVelocityCalibrated().getValue()[2];
+      this->yaw_rate_std = msg.getAngularVelocityCalibrated().getStd()[2];
+
+      double localizer_roll = msg.getOrientationNED().getValue()[0];
+      double localizer_roll_std = std::isnan(msg.getOrientationNED().getStd()[0]) ? M_PI / 180.0 : msg.getOrientationNED().getStd()[0];
+      bool roll_valid = (localizer_roll_std < ROLL_STD_MAX) && (ROLL_MIN < localizer_roll) && (localizer_roll < ROLL_MAX) && msg.getSensorsOK();
+      double roll, roll_std;
+      if (roll_valid) {
+        roll = localizer_roll;
+        // Experimentally found multiplier of 2 to be best trade-off between stability and accuracy or similar?
+        roll_std = 2 * localizer_roll_std;
+      } else {
+        // This is done to bound the road roll estimate when localizer values are invalid
+        roll = 0.0;
+        roll_std = 10.0 * M_PI / 180.0;
+      }
+      this->roll = std::clamp(roll, this->roll - ROLL_MAX_DELTA, this->roll + ROLL_MAX_DELTA);
+
+      bool yaw_rate_valid = msg.getAngularVelocityCalibrated().getValid();
+      yaw_rate_valid = yaw_rate_valid && 0 < this->yaw_rate_std && this->yaw_rate_std < 10;  // rad/s
+      yaw_rate_valid = yaw_rate_valid && std::abs(this->yaw_rate) < 1;  // rad/s
+
+      if (this->active) {
+        if (msg.getPosenetOK()) {
+          if (yaw_rate_valid) {
+            this->observe(t, ObservationKind::ROAD_FRAME_YAW_RATE, VectorXd::Constant(1, -this->yaw_rate), MatrixXdr::Constant(1, 1, std::pow(this->yaw_rate_std, 2)));
+          }
+          this->observe(t, ObservationKind::ROAD_ROLL, VectorXd::Constant(1, this->roll), MatrixXdr::Constant(1, 1, std::pow(roll_std, 2)));
+        }
+        this->observe(t, ObservationKind::ANGLE_OFFSET_FAST, VectorXd::Zero(1), obs_noise_R(car_obs_noise_diag, ObservationKind::ANGLE_OFFSET_FAST));
+
+        // We observe the current stiffness and steer ratio (with a high observation noise) to bound
+        // the respective estimate STD. Otherwise the STDs keep increasing, causing rapid changes in the
+        // states in longer routes (especially straight stretches).
+        VectorXd x = this->kf->state();
+        this->observe(t, ObservationKind::STIFFNESS, x.segment<1>(CAR_STATE_STIFFNESS_START), obs_noise_R(car_obs_noise_diag, ObservationKind::STIFFNESS));
+        this->observe(t, ObservationKind::STEER_RATIO, x.segment<1>(CAR_STATE_STEER_RATIO_START), obs_noise_R(car_obs_noise_diag, ObservationKind::STEER_RATIO));
+      }
+    } else if (event.which() == cereal::Event::CAR_STATE) {
+      auto msg = event.getCarState();
+      double speed = msg.getVEgo();
+      bool complex_dynamics = std::abs(msg.getAEgo()) > 1.0 || std::abs(msg.getSteeringRateDeg()) > 20;
+      bool in_linear_region = std::abs(msg.getSteeringAngleDeg()) < 45;
+      this->active = speed > MIN_ACTIVE_SPEED && in_linear_region && !complex_dynamics;
+
+      if (this->active) {
+        this->observe(t, ObservationKind::STEER_ANGLE, VectorXd::Constant(1, msg.getSteeringAngleDeg() * M_PI / 180.0), obs_noise_R(car_obs_noise_diag, ObservationKind::STEER_ANGLE));
+        this->observe(t, ObservationKind::ROAD_FRAME_X_SPEED, VectorXd::Constant(1, speed), obs_noise_R(car_obs_noise_diag, ObservationKind::ROAD_FRAME_X_SPEED));
+      }
+    } else {
+      return;
+    }
+
+    if (!this->active) {
+      // Reset time when stopped so uncertainty doesn't grow
+      this->kf->set_filter_time(t);
+      this->kf->reset_rewind();
+    }
+  }
+
+private:
+  void init(const cereal::CarParams::Reader &CP) {
+    VectorXd x = car_initial_x;
+    x[CAR_STATE_STEER_RATIO_START] = CP.getSteerRatio();
+    x[CAR_STATE_STIFFNESS_START] = 1.0;
+    x[CAR_STATE_ANGLE_OFFSET_START] = 0.0;
+    MatrixXdr P = car_P_initial_diag.asDiagonal();
+    MatrixXdr Q = car_Q_diag.asDiagonal();
+    this->kf = std::make_unique<EKFSym>("car", Map<MatrixXdr>(Q.data(), Q.rows(), Q.cols()), Map<VectorXd>(x.data(), x.rows()),
+                                        Map<MatrixXdr>(P.data(), P.rows(), P.cols()), CAR_DIM_STATE, CAR_DIM_STATE,
+                                        0, 0, 0, std::vector<int>(), std::vector<int>(), car_global_vars);
+
+    this->kf->set_global("mass", CP.getMass());
+    this->kf->set_global("rotational_inertia", CP.getRotationalInertia());
+    this->kf->set_global("center_to_front", CP.getCenterToFront());
+    this->kf->set_global("center_to_rear", CP.getWheelbase() - CP.getCenterToFront());
+    this->kf->set_global("stiffness_front", CP.getTireStiffnessFront());
+    this->kf->set_global("stiffness_rear", CP.getTireStiffnessRear());
+  }
+
+  bool active = false;
+  double yaw_rate = 0.0;
+  double yaw_rate_std = 0.0;
+  double roll = 0.0;
+};
+
+
+struct ReplayConfig {
+  std::string filter = "live";
+  std::string out_dir = ".";
+  double rate = 20.0;  // Hz, rate the state is written at
+};
+
+static bool replay_log(const std::string &path, const ReplayConfig &cfg) {
+  Rlog rlog;
+  if (!rlog.open(path)) {
+    fprintf(stderr, "%s: failed to open\n", path.c_str());
+    return false;
+  }
+
+  std::unique_ptr<Replayer> replayer;
+  if (cfg.filter == "car") {
+    replayer = std::make_unique<CarReplayer>();
+  } else {
+    replayer = std::make_unique<LiveReplayer>();
+  }
+
+  std::string base = path.substr(path.find_last_of('/') + 1);
+  std::string out_path = cfg.out_dir + "/" + base + "." + replayer->name() + ".csv";
+  FILE *out = fopen(out_path.c_str(), "w");
+  if (!out) {
+    fprintf(stderr, "%s: failed to open %s\n", path.c_str(), out_path.c_str());
+    return false;
+  }
+
+  double next_output = 0.0;
+  size_t n_rows = 0;
+  double t_filter;
+  VectorXd x, std;
+  rlog.for_each([&](const cereal::Event::Reader &event) {
+    double t = event.getLogMonoTime() * 1e-9;
+    replayer->handle_event(t, event);
+
+    if (t >= next_output && replayer->get_estimate(t_filter, x, std)) {
+      if (n_rows == 0) {
+        fprintf(out, "t");
+        for (int i = 0; i < x.rows(); i++) fprintf(out, ",x%d", i);
+        for (int i = 0; i < std.rows(); i++) fprintf(out, ",std%d", i);
+        fprintf(out, "\n");
+      }
+      fprintf(out, "%.6f", t_filter);
+      for (int i = 0; i < x.rows(); i++) fprintf(out, ",%.9g", x[i]);
+      for (int i = 0; i < std.rows(); i++) fprintf(out, ",%.9g", std[i]);
+      fprintf(out, "\n");
+      n_rows++;
+      next_output = t + 1.0 / cfg.rate;
+    }
+  });
+  fclose(out);
+
+  printf("%s: %zu events, %zu states -> %s\n", path.c_str(), rlog.n_events(), n_rows, out_path.c_str());
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  ReplayConfig cfg;
+  int jobs = std::max(1u, std::thread::hardware_concurrency());
+
+  int opt;
+  while ((opt = getopt(argc, argv, "f:j:r:o:h")) != -1) {
+    switch (opt) {
+      case 'f': cfg.filter = optarg; break;
+      case 'j': jobs = std::max(1, atoi(optarg)); break;
+      case 'r': cfg.rate = atof(optarg); break;
+      case 'o': cfg.out_dir = optarg; break;
+      default:
+        fprintf(stderr, "usage: %s [-f live|car] [-j jobs] [-r rate] [-o out_dir] rlog...\n", argv[0]);
+        return 1;
+    }
+  }
+  if (optind == argc || (cfg.filter != "live" && cfg.filter != "car") || cfg.rate <= 0) {
+    fprintf(stderr, "usage: %s [-f live|car] [-j jobs] [-r rate] [-o out_dir] rlog...\n", argv[0]);
+    return 1;
+  }
+
+  // one process per log, at most jobs at a time
+  int running = 0, failed = 0, status;
+  for (int i = optind; i < argc; i++) {
+    if (running == jobs) {
+      wait(&status);
+      failed += !(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+      running--;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+      _exit(replay_log(argv[i], cfg) ? 0 : 1);
+    } else if (pid < 0) {
+      perror("fork");
+      failed++;
+      continue;
+    }
+    running++;
+  }
+  while (running > 0) {
+    wait(&status);
+    failed += !(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    running--;
+  }
+
+  if (failed > 0) {
+    fprintf(stderr, "%d of %d logs failed\n", failed, argc - optind);
+  }
+  return failed > 0;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <vector>
+
+// Ring buffer of the last `len` rows of `width` floats. Every row is stored
+// twice, so the newest `len` rows are always contiguous (oldest first) and
+// can be handed to the model as an input buffer without copying.
+class HistoryBuffer {
+public:
+  HistoryBuffer(int len, int width) : len(len), width(width), head(len - 1), buf(2 * len * width, 0.0f) {}
+
+  void push(const float *row) {
+    head = (head + 1) % len;
+    memcpy(&buf[head * width], row, width * sizeof(float));
+    memcpy(&buf[(head + len) * width], row, width * sizeof(float));
+  }
+
+  const float *window() const { return &buf[(head + 1) * width]; }
+
+  // max over consecutive groups of `group` rows, aligned to the newest row
+  void max_pool(float *out, int group) const {
+    assert(len % group == 0);
+    const float *w = window();
+    for (int g = 0; g < len / group; g++) {
+      const float *src = w + g * group * width;
+      std::copy(src, src + width, out + g * width);
+      for (int r = 1; r < group; r++) {
+        for (int i = 0; i < width; i++) {
+          out[g * width + i] = std::max(out[g * width + i], src[r * width + i]);
+        }
+      }
+    }
+  }
+
+  const int len, width;
+
+private:
+  int head;
+  std::vector<float> buf;
+};
+
+// History sampled every `stride` rows, ending `stride - 1` rows before the newest
+// one, i.e. the rows full_history[-stride::-stride] the model sees on the next
+// frame. Each phase keeps its own ring, so pushing a row touches only one ring.
+class DecimatedHistoryBuffer {
+public:
+  DecimatedHistoryBuffer(int len, int width, int stride) : len(len), width(width), stride(stride), count(0),
+                                                           phases(stride, HistoryBuffer(len, width)) {}
+
+  void push(const float *row) {
+    phases[count % stride].push(row);
+    count++;
+  }
+
+  const float *window() const { return phases[count % stride].window(); }
+
+  const int len, width, stride;
+
+private:
+  long count;
+  std::vector<HistoryBuffer> phases;
+};
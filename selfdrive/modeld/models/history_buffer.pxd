@@ -0,0 +1,15 @@
+# distutils: language = c++
+
+cdef extern from "selfdrive/modeld/models/history_buffer.h":
+  cppclass HistoryBuffer:
+    int len, width
+    HistoryBuffer(int, int)
+    void push(const float *)
+    const float * window()
+    void max_pool(float *, int)
+
+  cppclass DecimatedHistoryBuffer:
+    int len, width, stride
+    DecimatedHistoryBuffer(int, int, int)
+    void push(const float *)
+    const float * window()
@@ -0,0 +1,50 @@
+# distutils: language = c++
+# cython: c_string_encoding=ascii, language_level=3
+
+import numpy as np
+cimport numpy as cnp
+
+from .history_buffer cimport HistoryBuffer as cppHistoryBuffer
+from .history_buffer cimport DecimatedHistoryBuffer as cppDecimatedHistoryBuffer
+
+
+cdef class HistoryBuffer:
+  cdef cppHistoryBuffer * buf
+
+  def __cinit__(self, int length, int width):
+    self.buf = new cppHistoryBuffer(length, width)
+
+  def __dealloc__(self):
+    del self.buf
+
+  def push(self, const float[::1] row):
+    assert len(row) == self.buf.width
+    self.buf.push(&row[0])
+
+  def window(self):
+    # read-only view of the newest rows, oldest first; valid until the next push
+    arr = np.asarray(<cnp.float32_t[:self.buf.len, :self.buf.width]> <float *> self.buf.window())
+    arr.flags.writeable = False
+    return arr
+
+  def max_pool(self, float[::1] out, int group):
+    assert len(out) == (self.buf.len // group) * self.buf.width
+    self.buf.max_pool(&out[0], group)
+
+
+cdef class DecimatedHistoryBuffer:
+  cdef cppDecimatedHistoryBuffer * buf
+
+  def __cinit__(self, int length, int width, int stride):
+    self.buf = new cppDecimatedHistoryBuffer(length, width, stride)
+
+  def __dealloc__(self):
+    del self.buf
+
+  def push(self, const float[::1] row):
+    assert len(row) == self.buf.width
+    self.buf.push(&row[0])
+
+  def window(self):
+    # flat view usable as a model input buffer; valid until the next push
+    return np.asarray(<cnp.float32_t[:self.buf.len * self.buf.width]> <float *> self.buf.window())
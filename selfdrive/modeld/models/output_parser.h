@@ -0,0 +1,118 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+#include <vector>
+
+// Activations and mixture density selection for the flat supercombo output,
+// mirroring parse_model_outputs.py. The loops are kept branch-free over
+// contiguous data so the compiler can vectorize them.
+
+// exp without a libm call so the loops using it vectorize. Cephes expf range
+// reduction and polynomial, within 2 ulp of std::exp. Inputs above 11 are clipped
+// like safe_exp in parse_model_outputs.py: exp(11) is about 6e4, just below the
+// float16 max of 65504. Inputs below -87 give exp(-87), about 1.6e-38, which stays
+// just above the denormals (2**-126 is about 1.2e-38).
+inline float safe_exp(float x) {
+  x = std::max(std::min(x, 11.0f), -87.0f);
+
+  // k = round(x / ln2), biased so the truncating conversion floors
+  const int k = (int)(x * 1.44269504088896341f + 128.5f) - 128;
+  const float kf = (float)k;
+  const float r = x - kf * 0.693359375f + kf * 2.12194440e-4f;
+
+  float p = 1.9875691500e-4f;
+  p = p * r + 1.3981999507e-3f;
+  p = p * r + 8.3334519073e-3f;
+  p = p * r + 4.1665795894e-2f;
+  p = p * r + 1.6666665459e-1f;
+  p = p * r + 5.0000001201e-1f;
+  p = p * r * r + r + 1.0f;
+
+  // 2**k from the exponent bits
+  const int32_t bits = (k + 127) << 23;
+  float scale;
+  std::memcpy(&scale, &bits, sizeof(scale));
+  return p * scale;
+}
+
+inline void sigmoid(const float *in, float *out, int n) {
+  for (int i = 0; i < n; i++) {
+    out[i] = 1.0f / (1.0f + safe_exp(-in[i]));
+  }
+}
+
+// softmax over n values, read every in_stride and written every out_stride elements
+inline void softmax(const float *in, float *out, int n, int in_stride = 1, int out_stride = 1) {
+  float max_val = in[0];
+  for (int i = 1; i < n; i++) {
+    max_val = std::max(max_val, in[i * in_stride]);
+  }
+  float sum = 0.0f;
+  for (int i = 0; i < n; i++) {
+    out[i * out_stride] = safe_exp(in[i * in_stride] - max_val);
+    sum += out[i * out_stride];
+  }
+  for (int i = 0; i < n; i++) {
+    out[i * out_stride] /= sum;
+  }
+}
+
+// raw holds max(in_N, 1) hypotheses of [mu (n_values), log std (n_values), weight logits (out_N)].
+// mu/std receive all hypotheses, mu_final/std_final the out_N most likely ones.
+// Without hypotheses (in_N <= 1) weights is unused and mu/std may alias mu_final/std_final.
+inline void parse_mdn(const float *raw, int in_N, int out_N, int n_values,
+                      float *mu, float *std, float *weights, float *mu_final, float *std_final) {
+  const int n_hyp = std::max(in_N, 1);
+  const int row = 2 * n_values + out_N;
+  for (int h = 0; h < n_hyp; h++) {
+    const float *src = raw + h * row;
+    std::copy(src, src + n_values, mu + h * n_values);
+    for (int i = 0; i < n_values; i++) {
+      std[h * n_values + i] = safe_exp(src[n_values + i]);
+    }
+  }
+
+  if (in_N <= 1) {
+    if (mu != mu_final) {
+      std::copy(mu, mu + n_hyp * n_values, mu_final);
+      std::copy(std, std + n_hyp * n_values, std_final);
+    }
+    return;
+  }
+
+  for (int i = 0; i < out_N; i++) {
+    softmax(raw + 2 * n_values + i, weights + i, in_N, row, out_N);
+  }
+
+  // Equal weights are ordered by hypothesis index and the selection below takes the
+  // first maximum. This differs from np.argsort(w)[::-1] in parse_model_outputs.py
+  // only on ties: numpy's default argsort isn't stable, and with its SIMD sorts the
+  // order of equal float32 weights depends on the CPU and the numpy version, so no
+  // fixed rule reproduces it.
+  if (out_N == 1) {
+    // order hypotheses by decreasing weight
+    std::vector<int> idxs(in_N);
+    std::iota(idxs.begin(), idxs.end(), 0);
+    std::stable_sort(idxs.begin(), idxs.end(), [&](int a, int b) { return weights[a] > weights[b]; });
+    std::vector<float> tmp_w(weights, weights + in_N);
+    std::vector<float> tmp_mu(mu, mu + in_N * n_values), tmp_std(std, std + in_N * n_values);
+    for (int h = 0; h < in_N; h++) {
+      weights[h] = tmp_w[idxs[h]];
+      std::copy_n(&tmp_mu[idxs[h] * n_values], n_values, mu + h * n_values);
+      std::copy_n(&tmp_std[idxs[h] * n_values], n_values, std + h * n_values);
+    }
+  }
+
+  for (int i = 0; i < out_N; i++) {
+    int best = 0;
+    for (int h = 1; h < in_N; h++) {
+      if (weights[h * out_N + i] > weights[best * out_N + i]) best = h;
+    }
+    std::copy_n(mu + best * n_values, n_values, mu_final + i * n_values);
+    std::copy_n(std + best * n_values, n_values, std_final + i * n_values);
+  }
+}
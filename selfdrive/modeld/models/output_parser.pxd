@@ -0,0 +1,6 @@
+# distutils: language = c++
+
+cdef extern from "selfdrive/modeld/models/output_parser.h":
+  void sigmoid(const float *, float *, int)
+  void softmax(const float *, float *, int, int, int)
+  void parse_mdn(const float *, int, int, int, float *, float *, float *, float *, float *)
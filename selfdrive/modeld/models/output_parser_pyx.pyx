@@ -0,0 +1,101 @@
+# distutils: language = c++
+# cython: c_string_encoding=ascii, language_level=3
+
+import numpy as np
+from openpilot.selfdrive.modeld.constants import ModelConstants
+
+from .output_parser cimport sigmoid, softmax, parse_mdn
+
+# name: (in_N, out_N, out_shape), same as Parser.parse_outputs
+MDN_OUTPUTS = {
+  'plan': (ModelConstants.PLAN_MHP_N, ModelConstants.PLAN_MHP_SELECTION, (ModelConstants.IDX_N, ModelConstants.PLAN_WIDTH)),
+  'lane_lines': (0, 0, (ModelConstants.NUM_LANE_LINES, ModelConstants.IDX_N, ModelConstants.LANE_LINES_WIDTH)),
+  'road_edges': (0, 0, (ModelConstants.NUM_ROAD_EDGES, ModelConstants.IDX_N, ModelConstants.LANE_LINES_WIDTH)),
+  'pose': (0, 0, (ModelConstants.POSE_WIDTH,)),
+  'road_transform': (0, 0, (ModelConstants.POSE_WIDTH,)),
+  'wide_from_device_euler': (0, 0, (ModelConstants.WIDE_FROM_DEVICE_WIDTH,)),
+  'lead': (ModelConstants.LEAD_MHP_N, ModelConstants.LEAD_MHP_SELECTION, (ModelConstants.LEAD_TRAJ_LEN, ModelConstants.LEAD_WIDTH)),
+  'lat_planner_solution': (0, 0, (ModelConstants.IDX_N, ModelConstants.LAT_PLANNER_SOLUTION_WIDTH)),
+  'desired_curvature': (0, 0, (ModelConstants.DESIRED_CURV_WIDTH,)),
+}
+BINARY_OUTPUTS = ['lead_prob', 'lane_lines_prob', 'meta']
+CATEGORICAL_OUTPUTS = {
+  'desire_state': (ModelConstants.DESIRE_PRED_WIDTH,),
+  'desire_pred': (ModelConstants.DESIRE_PRED_LEN, ModelConstants.DESIRE_PRED_WIDTH),
+}
+OPTIONAL_OUTPUTS = {'lat_planner_solution', 'desired_curvature'}
+
+
+cdef class OutputParser:
+  """Native equivalent of Parser.parse_outputs(slice_outputs(output)).
+
+  Parsed outputs are written into buffers allocated once here, so the returned
+  arrays are only valid until the next call.
+  """
+  cdef dict slices
+  cdef dict outs
+  cdef list mdn
+  cdef list binary
+  cdef list categorical
+
+  def __init__(self, dict output_slices, int output_size, bint ignore_missing=False):
+    self.slices = {k: range(*v.indices(output_size)) for k, v in output_slices.items()}
+    self.outs = {}
+    self.mdn, self.binary, self.categorical = [], [], []
+
+    for name in [*MDN_OUTPUTS, *BINARY_OUTPUTS, *CATEGORICAL_OUTPUTS]:
+      if name not in self.slices and name not in OPTIONAL_OUTPUTS and not ignore_missing:
+        raise ValueError(f"Missing output {name}")
+
+    for name, (in_N, out_N, out_shape) in MDN_OUTPUTS.items():
+      if name not in self.slices:
+        continue
+      n_hyp = max(in_N, 1)
+      n_values = (len(self.slices[name]) // n_hyp - out_N) // 2
+      final_shape = (1, out_N, *out_shape) if out_N > 1 else (1, *out_shape)
+      self.outs[name] = np.zeros(final_shape, dtype=np.float32)
+      self.outs[name + '_stds'] = np.zeros(final_shape, dtype=np.float32)
+      if in_N > 1:
+        self.outs[name + '_weights'] = np.zeros((1, in_N, out_N), dtype=np.float32)
+        self.outs[name + '_hypotheses'] = np.zeros((1, in_N, *out_shape), dtype=np.float32)
+        self.outs[name + '_stds_hypotheses'] = np.zeros((1, in_N, *out_shape), dtype=np.float32)
+      self.mdn.append((name, self.slices[name].start, in_N, out_N, n_values))
+
+    for name in BINARY_OUTPUTS:
+      if name in self.slices:
+        self.outs[name] = np.zeros((1, len(self.slices[name])), dtype=np.float32)
+        self.binary.append((name, self.slices[name].start, len(self.slices[name])))
+
+    for name, out_shape in CATEGORICAL_OUTPUTS.items():
+      if name in self.slices:
+        self.outs[name] = np.zeros((1, *out_shape), dtype=np.float32)
+        self.categorical.append((name, self.slices[name].start, len(self.slices[name]) // out_shape[-1], out_shape[-1]))
+
+  def parse_outputs(self, float[::1] output) -> dict:
+    cdef float[::1] mu, std, weights, mu_final, std_final, out
+    cdef int start, in_N, out_N, n_values, n, groups, width, g
+
+    for name, start, in_N, out_N, n_values in self.mdn:
+      mu_final = self.outs[name].reshape(-1)
+      std_final = self.outs[name + '_stds'].reshape(-1)
+      if in_N > 1:
+        mu = self.outs[name + '_hypotheses'].reshape(-1)
+        std = self.outs[name + '_stds_hypotheses'].reshape(-1)
+        weights = self.outs[name + '_weights'].reshape(-1)
+        parse_mdn(&output[start], in_N, out_N, n_values, &mu[0], &std[0], &weights[0], &mu_final[0], &std_final[0])
+      else:
+        parse_mdn(&output[start], in_N, out_N, n_values, &mu_final[0], &std_final[0], NULL, &mu_final[0], &std_final[0])
+
+    for name, start, n in self.binary:
+      out = self.outs[name].reshape(-1)
+      sigmoid(&output[start], &out[0], n)
+
+    for name, start, groups, width in self.categorical:
+      out = self.outs[name].reshape(-1)
+      for g in range(groups):
+        softmax(&output[start + g * width], &out[g * width], width, 1, 1)
+
+    raw = np.asarray(output)
+    outs = {k: raw[np.newaxis, v.start:v.stop] for k, v in self.slices.items()}
+    outs.update(self.outs)
+    return outs
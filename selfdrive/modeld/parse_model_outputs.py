@@ -2,7 +2,7 @@ import numpy as np
 from openpilot.selfdrive.modeld.constants import ModelConstants
 
 def safe_exp(x, out=None):
-  # -11 is around 10**14, more causes float16 overflow
+  # exp(11) is about 6e4, more causes float16 overflow
   return np.exp(np.clip(x, -np.inf, 11), out=out)
 
 def sigmoid(x):
@@ -0,0 +1,295 @@
+// Times the driving model pipeline on recorded frames, without camerad or a car: VisionIpc
+// send/recv, ModelFrame::prepare for the road and wide road camera, the thneed model and
+// the output parsing kernels, with the mean, percentiles and throughput of every stage.
+// Built once with the ModelFrame of modeld and once with the one of classic_modeld.
+//
+//   scons --pc-thneed benchmark_modeld   # on a PC, on device without --pc-thneed
+//   ./selfdrive/modeld/tests/benchmark_modeld -W 1928 -H 1208 fcamera.nv12
+//   ./selfdrive/classic_modeld/tests/benchmark_modeld -W 1928 -H 1208 fcamera.nv12
+//
+// Frames are raw back-to-back NV12, a camera file converts with
+//   ffmpeg -i fcamera.hevc -pix_fmt nv12 -f rawvideo fcamera.nv12
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "common/clutil.h"
+#include "common/mat.h"
+#include "msgq/visionipc/visionipc_client.h"
+#include "msgq/visionipc/visionipc_server.h"
+#include "selfdrive/modeld/models/output_parser.h"
+#include "selfdrive/modeld/runners/thneedmodel.h"
+#ifdef CLASSIC_MODELD
+#include "selfdrive/classic_modeld/models/commonmodel.h"
+#else
+#include "selfdrive/modeld/models/commonmodel.h"
+#endif
+
+struct BenchmarkConfig {
+  std::string model_path = MODEL_PATH;
+  std::string layout_path = MODEL_LAYOUT_PATH;
+  std::string frames_path;
+  int width = 0;
+  int height = 0;
+  int frames = 200;
+  int warmup = 20;
+};
+
+enum Stage { VIPC, PREPARE, EXECUTE, PARSE, TOTAL, STAGE_CNT };
+const char *STAGE_NAMES[STAGE_CNT] = {"vipc", "prepare", "execute", "parse", "total"};
+
+// Input sizes and output slices of the model, as written by dump_model_layout.py
+struct ModelLayout {
+  std::vector<std::pair<std::string, int>> inputs;
+  std::map<std::string, std::pair<int, int>> outputs;  // name -> [start, stop)
+  int output_size = 0;
+};
+
+static bool read_layout(const std::string &path, ModelLayout &layout) {
+  std::ifstream f(path);
+  std::string kind, name;
+  while (f >> kind) {
+    if (kind == "input") {
+      int size;
+      f >> name >> size;
+      layout.inputs.push_back({name, size});
+    } else if (kind == "output") {
+      int start, stop;
+      f >> name >> start >> stop;
+      layout.outputs[name] = {start, stop};
+    } else if (kind == "outputs") {
+      f >> layout.output_size;
+    } else {
+      return false;
+    }
+  }
+  return !f.bad() && layout.output_size > 0;
+}
+
+// The work of OutputParser.parse_outputs in output_parser_pyx.pyx, on buffers allocated once
+class OutputParser {
+public:
+  explicit OutputParser(const ModelLayout &layout) {
+    // name: (in_N, out_N), same as MDN_OUTPUTS
+    const std::pair<const char *, std::pair<int, int>> mdn_outputs[] = {
+      {"plan", {5, 1}}, {"lane_lines", {0, 0}}, {"road_edges", {0, 0}}, {"pose", {0, 0}},
+      {"road_transform", {0, 0}}, {"wide_from_device_euler", {0, 0}}, {"lead", {2, 3}},
+      {"lat_planner_solution", {0, 0}}, {"desired_curvature", {0, 0}},
+    };
+    for (const auto &[name, n] : mdn_outputs) {
+      auto it = layout.outputs.find(name);
+      if (it == layout.outputs.end()) continue;
+      const auto [in_N, out_N] = n;
+      const int n_hyp = std::max(in_N, 1);
+      const int n_values = ((it->second.second - it->second.first) / n_hyp - out_N) / 2;
+      const int n_final = std::max(out_N, 1) * n_values;
+      mdn.push_back({it->second.first, in_N, out_N, n_values, std::vector<float>(2 * n_hyp * n_values + 2 * n_final + n_hyp * out_N)});
+    }
+    for (const char *name : {"lead_prob", "lane_lines_prob", "meta"}) {
+      auto it = layout.outputs.find(name);
+      if (it == layout.outputs.end()) continue;
+      binary.push_back({it->second.first, it->second.second - it->second.first, {}});
+      binary.back().out.resize(binary.back().n);
+    }
+    for (const char *name : {"desire_state", "desire_pred"}) {
+      auto it = layout.outputs.find(name);
+      if (it == layout.outputs.end()) continue;
+      categorical.push_back({it->second.first, it->second.second - it->second.first, {}});
+      categorical.back().out.resize(categorical.back().n);
+    }
+  }
+
+  void parse(const float *output) {
+    for (auto &o : mdn) {
+      const int n = std::max(o.in_N, 1) * o.n_values;
+      const int n_final = std::max(o.out_N, 1) * o.n_values;
+      float *mu = o.buf.data(), *stds = mu + n, *mu_final = stds + n, *std_final = mu_final + n_final, *weights = std_final + n_final;
+      if (o.in_N > 1) {
+        parse_mdn(output + o.start, o.in_N, o.out_N, o.n_values, mu, stds, weights, mu_final, std_final);
+      } else {
+        parse_mdn(output + o.start, o.in_N, o.out_N, o.n_values, mu_final, std_final, nullptr, mu_final, std_final);
+      }
+    }
+    for (auto &o : binary) {
+      sigmoid(output + o.start, o.out.data(), o.n);
+    }
+    // DESIRE_PRED_WIDTH wide groups
+    for (auto &o : categorical) {
+      for (int g = 0; g < o.n / 8; g++) {
+        softmax(output + o.start + g * 8, o.out.data() + g * 8, 8);
+      }
+    }
+  }
+
+private:
+  struct Mdn {
+    int start, in_N, out_N, n_values;
+    std::vector<float> buf;  // hypotheses, their stds, the selected ones, their stds, weights
+  };
+  struct Flat {
+    int start, n;
+    std::vector<float> out;
+  };
+  std::vector<Mdn> mdn;
+  std::vector<Flat> binary;
+  std::vector<Flat> categorical;
+};
+
+// linear interpolation between the closest ranks, like np.percentile
+static double percentile(const std::vector<double> &sorted, double p) {
+  double pos = p / 100.0 * (sorted.size() - 1);
+  size_t lo = (size_t)pos;
+  size_t hi = std::min(lo + 1, sorted.size() - 1);
+  return sorted[lo] + (sorted[hi] - sorted[lo]) * (pos - lo);
+}
+
+static void print_report(std::vector<double> (&timings)[STAGE_CNT]) {
+  double total = 0;
+  for (double t : timings[TOTAL]) total += t;
+  const size_t n = timings[TOTAL].size();
+  printf("%zu frames, %.1f frames/s\n", n, 1e3 * n / total);
+  printf("%10s %8s %8s %8s %8s %8s  (ms)\n", "stage", "mean", "p50", "p90", "p99", "max");
+  for (int s = 0; s < STAGE_CNT; s++) {
+    std::vector<double> t = timings[s];
+    std::sort(t.begin(), t.end());
+    double sum = 0;
+    for (double v : t) sum += v;
+    printf("%10s %8.2f %8.2f %8.2f %8.2f %8.2f\n", STAGE_NAMES[s], sum / n,
+           percentile(t, 50), percentile(t, 90), percentile(t, 99), t.back());
+  }
+}
+
+static int run(const BenchmarkConfig &cfg) {
+  ModelLayout layout;
+  if (!read_layout(cfg.layout_path, layout)) {
+    fprintf(stderr, "failed to read the model layout from %s\n", cfg.layout_path.c_str());
+    return 1;
+  }
+
+  const size_t frame_size = (size_t)cfg.width * cfg.height * 3 / 2;
+  std::vector<std::vector<uint8_t>> frames;
+  FILE *f = fopen(cfg.frames_path.c_str(), "rb");
+  if (!f) {
+    fprintf(stderr, "failed to open %s\n", cfg.frames_path.c_str());
+    return 1;
+  }
+  for (int i = 0; i < cfg.frames; i++) {
+    std::vector<uint8_t> frame(frame_size);
+    if (fread(frame.data(), 1, frame_size, f) != frame_size) break;
+    frames.push_back(std::move(frame));
+  }
+  fclose(f);
+  if (frames.empty()) {
+    fprintf(stderr, "no %d x %d frame in %s\n", cfg.width, cfg.height, cfg.frames_path.c_str());
+    return 1;
+  }
+  printf("loaded %zu frames (%d x %d) from %s\n", frames.size(), cfg.width, cfg.height, cfg.frames_path.c_str());
+
+  cl_device_id device_id = cl_get_device_id(CL_DEVICE_TYPE_DEFAULT);
+  cl_context context = cl_create_context(device_id);
+
+  const VisionStreamType streams[] = {VISION_STREAM_ROAD, VISION_STREAM_WIDE_ROAD};
+  VisionIpcServer vipc_server("benchmark_modeld", device_id, context);
+  for (VisionStreamType stream : streams) {
+    vipc_server.create_buffers_with_sizes(stream, 4, false, cfg.width, cfg.height, frame_size, cfg.width, cfg.width * cfg.height);
+  }
+  vipc_server.start_listener();
+  VisionIpcClient client_main("benchmark_modeld", VISION_STREAM_ROAD, true, device_id, context);
+  VisionIpcClient client_extra("benchmark_modeld", VISION_STREAM_WIDE_ROAD, true, device_id, context);
+  bool connected = client_main.connect(true) && client_extra.connect(true);
+  assert(connected);
+
+  // the input images are the only inputs in CL buffers, the rest stay zero like on a straight road
+  std::vector<float> output(layout.output_size);
+  ThneedModel model(cfg.model_path, output.data(), output.size(), USE_GPU_RUNTIME, false, context);
+  std::vector<std::vector<float>> inputs;
+  for (const auto &[name, size] : layout.inputs) {
+    if (name == "input_imgs" || name == "big_input_imgs") {
+      model.addInput(name, nullptr, 0);
+    } else {
+      inputs.emplace_back(size);
+      model.addInput(name, inputs.back().data(), size);
+    }
+  }
+  OutputParser parser(layout);
+
+  // a fixed crop from the middle of the frame, the warp costs the same for any transform
+  const mat3 transform = {{2.0f, 0.0f, (cfg.width - 1024) / 2.0f,
+                           0.0f, 2.0f, (cfg.height - 512) / 2.0f,
+                           0.0f, 0.0f, 1.0f}};
+  ModelFrame frame(device_id, context);
+  ModelFrame wide_frame(device_id, context);
+
+  std::vector<double> timings[STAGE_CNT];
+  for (int i = 0; i < cfg.warmup + (int)frames.size(); i++) {
+    const std::vector<uint8_t> &yuv = frames[i % frames.size()];
+    VisionIpcBufExtra extra = {};
+    extra.frame_id = i;
+    extra.timestamp_sof = extra.timestamp_eof = i * 50000000ULL;
+
+    auto t0 = std::chrono::steady_clock::now();
+    for (VisionStreamType stream : streams) {
+      VisionBuf *buf = vipc_server.get_buffer(stream);
+      memcpy(buf->addr, yuv.data(), frame_size);
+      vipc_server.send(buf, &extra);
+    }
+    VisionBuf *buf_main = client_main.recv();
+    VisionBuf *buf_extra = client_extra.recv();
+    assert(buf_main != nullptr && buf_extra != nullptr);
+    auto t1 = std::chrono::steady_clock::now();
+    // with the CL buffers of the model as output, prepare returns nullptr
+    model.setInputBuffer("input_imgs", (float *)frame.prepare(buf_main->buf_cl, buf_main->width, buf_main->height, buf_main->stride,
+                                                               buf_main->uv_offset, transform, (cl_mem *)model.getCLBuffer("input_imgs")), 0);
+    model.setInputBuffer("big_input_imgs", (float *)wide_frame.prepare(buf_extra->buf_cl, buf_extra->width, buf_extra->height, buf_extra->stride,
+                                                                        buf_extra->uv_offset, transform, (cl_mem *)model.getCLBuffer("big_input_imgs")), 0);
+    auto t2 = std::chrono::steady_clock::now();
+    model.execute();
+    auto t3 = std::chrono::steady_clock::now();
+    parser.parse(output.data());
+    auto t4 = std::chrono::steady_clock::now();
+
+    if (i >= cfg.warmup) {
+      const std::chrono::steady_clock::time_point ts[] = {t0, t1, t2, t3, t4};
+      for (int s = VIPC; s < TOTAL; s++) {
+        timings[s].push_back(std::chrono::duration<double, std::milli>(ts[s + 1] - ts[s]).count());
+      }
+      timings[TOTAL].push_back(std::chrono::duration<double, std::milli>(t4 - t0).count());
+    }
+  }
+  print_report(timings);
+
+  CL_CHECK(clReleaseContext(context));
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  BenchmarkConfig cfg;
+  bool usage = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "m:L:W:H:n:w:")) != -1) {
+    switch (opt) {
+      case 'm': cfg.model_path = optarg; break;
+      case 'L': cfg.layout_path = optarg; break;
+      case 'W': cfg.width = atoi(optarg); break;
+      case 'H': cfg.height = atoi(optarg); break;
+      case 'n': cfg.frames = std::max(1, atoi(optarg)); break;
+      case 'w': cfg.warmup = std::max(0, atoi(optarg)); break;
+      default: usage = true; break;
+    }
+  }
+  if (usage || cfg.width <= 0 || cfg.height <= 0 || optind != argc - 1) {
+    fprintf(stderr, "usage: %s -W width -H height [-n frames] [-w warmup] [-m model.thneed] [-L layout.txt] frames.nv12\n", argv[0]);
+    return 1;
+  }
+  cfg.frames_path = argv[optind];
+  return run(cfg);
+}
@@ -0,0 +1,19 @@
+#!/usr/bin/env python3
+# Writes the input sizes and output slices of a model metadata pickle as text for
+# benchmark_modeld: "input <name> <size>", "output <name> <start> <stop>" and "outputs <size>"
+import math
+import pickle
+import sys
+
+if __name__ == "__main__":
+  with open(sys.argv[1], 'rb') as f:
+    metadata = pickle.load(f)
+
+  output_size = metadata['output_shapes']['outputs'][1]
+  with open(sys.argv[2], 'w') as f:
+    for name, shape in metadata['input_shapes'].items():
+      f.write(f"input {name} {math.prod(shape)}\n")
+    for name, s in metadata['output_slices'].items():
+      start, stop, _ = s.indices(output_size)
+      f.write(f"output {name} {start} {stop}\n")
+    f.write(f"outputs {output_size}\n")
@@ -1,5 +1,6 @@
 #include "selfdrive/navd/map_renderer.h"
 
+#include <algorithm>
 #include <cmath>
 #include <string>
 #include <QApplication>
@@ -8,6 +9,7 @@
 #include "common/util.h"
 #include "common/timing.h"
 #include "common/swaglog.h"
+#include "system/hardware/hw.h"
 #include "selfdrive/ui/qt/maps/map_helpers.h"
 
 const float DEFAULT_ZOOM = 13.5; // Don't go below 13 or features will start to disappear
@@ -18,9 +20,26 @@ const int EARTH_CIRCUMFERENCE_METERS = 40075000;
 const int EARTH_RADIUS_METERS = 6378137;
 const int PIXELS_PER_TILE = 256;
 const int MAP_OFFSET = 128;
+// Choose a scale that ensures above 13 zoom level up to and above 75deg of lat
+const float METERS_PER_PIXEL = 2;
+
+// the cache database is kept across drives, tiles of the route are prefetched into it
+const std::string CACHE_PATH = util::getenv("MAP_CACHE_PATH", Hardware::PC() ? Path::comma_home() + "/map_cache.db" : "/data/media/0/map_cache.db");
+const qint64 CACHE_SIZE_MAX = 512 * 1024 * 1024;
+// distance between the route points the corridor is built from, and its half width: the
+// half diagonal of the view plus the offset of the view ahead of the car
+const float CORRIDOR_STEP_METERS = 100;
+const float CORRIDOR_RADIUS_METERS = WIDTH * METERS_PER_PIXEL / M_SQRT2 + MAP_OFFSET;
+// pause between two prefetch renders, leaves the GPU and network to the renderer
+const int PREFETCH_INTERVAL_MS = 250;
 
 const bool TEST_MODE = getenv("MAP_RENDER_TEST_MODE");
 const int LLK_DECIMATION = TEST_MODE ? 1 : 10;
+const int RENDER_LATENCY_BIN_MS = 50;
+// a static render that hasn't finished by then is given up on
+const double RENDER_TIMEOUT_MS = 2000;
+// longest wait for a frame readback when both buffers are in flight
+const GLuint64 READBACK_TIMEOUT_NS = 100 * 1000 * 1000;
 
 float get_zoom_level_for_scale(float lat, float meters_per_pixel) {
   float meters_per_tile = meters_per_pixel * PIXELS_PER_TILE;
@@ -37,7 +56,146 @@ QMapLibre::Coordinate get_point_along_line(float lat, float lon, float bearing,
 }
 
 
-MapRenderer::MapRenderer(const QMapLibre::Settings &settings, bool online) : m_settings(settings) {
+// slippy map tile (z, x, y) containing a coordinate
+static std::tuple<int, int, int> get_tile(double lat, double lon, int z) {
+  const int n = 1 << z;
+  int x = std::clamp((int)std::floor((lon + 180.0) / 360.0 * n), 0, n - 1);
+  int y = std::clamp((int)std::floor((1.0 - std::asinh(std::tan(DEG2RAD(lat))) / M_PI) / 2.0 * n), 0, n - 1);
+  return {z, x, y};
+}
+
+static QMapLibre::Coordinate get_tile_center(const std::tuple<int, int, int> &tile) {
+  auto [z, x, y] = tile;
+  const double n = 1 << z;
+  double lon = (x + 0.5) / n * 360.0 - 180.0;
+  double lat = RAD2DEG(std::atan(std::sinh(M_PI * (1.0 - 2.0 * (y + 0.5) / n))));
+  return QMapLibre::Coordinate(lat, lon);
+}
+
+// Makes a context current for its scope and gives the previous one back
+class ScopedContext {
+public:
+  ScopedContext(QOpenGLContext *ctx, QOffscreenSurface *surface) : prev_ctx(QOpenGLContext::currentContext()) {
+    prev_surface = prev_ctx ? prev_ctx->surface() : nullptr;
+    ctx->makeCurrent(surface);
+  }
+  ~ScopedContext() {
+    if (prev_ctx) {
+      prev_ctx->makeCurrent(prev_surface);
+    }
+  }
+
+private:
+  QOpenGLContext *prev_ctx;
+  QSurface *prev_surface;
+};
+
+MapPrefetcher::MapPrefetcher(const QMapLibre::Settings &settings, const std::string &style, const QSurfaceFormat &format) {
+  // own context, so the renderer's GL state is never touched by the prefetch renders
+  ctx = std::make_unique<QOpenGLContext>();
+  ctx->setFormat(format);
+  ctx->create();
+  assert(ctx->isValid());
+
+  surface = std::make_unique<QOffscreenSurface>();
+  surface->setFormat(ctx->format());
+  surface->create();
+
+  ScopedContext scoped_ctx(ctx.get(), surface.get());
+  QOpenGLFramebufferObjectFormat fbo_format;
+  fbo.reset(new QOpenGLFramebufferObject(WIDTH, HEIGHT, fbo_format));
+
+  m_map.reset(new QMapLibre::Map(nullptr, settings, fbo->size(), 1));
+  m_map->setCoordinateZoom(QMapLibre::Coordinate(0, 0), DEFAULT_ZOOM);
+  m_map->setStyleJson(style.c_str());
+  m_map->createRenderer();
+  m_map->resize(fbo->size());
+  m_map->setFramebufferObject(fbo->handle(), fbo->size());
+
+  QObject::connect(m_map.data(), &QMapLibre::Map::needsRendering, m_map.data(), [=]() {
+    ScopedContext render_ctx(ctx.get(), surface.get());
+    m_map->render();
+  });
+  QObject::connect(m_map.data(), &QMapLibre::Map::staticRenderFinished, m_map.data(), [=](const QString &error) {
+    if (!error.isEmpty()) {
+      LOGW("Prefetching tile %zu/%zu failed: '%s'", next_tile, tile_centers.size(), error.toStdString().c_str());
+    }
+    render_pending = false;
+    QTimer::singleShot(PREFETCH_INTERVAL_MS, m_map.data(), [=]() { renderNext(); });
+  });
+}
+
+MapPrefetcher::~MapPrefetcher() {
+  ScopedContext scoped_ctx(ctx.get(), surface.get());
+  m_map.reset();
+  fbo.reset();
+}
+
+void MapPrefetcher::updateRoute(const QList<QGeoCoordinate> &coordinates) {
+  std::set<std::tuple<int, int, int>> tiles;
+  tile_centers.clear();
+  next_tile = 0;
+
+  auto add_tiles = [&](double lat, double lon) {
+    int z = std::floor(get_zoom_level_for_scale(lat, METERS_PER_PIXEL));
+    // the view can be rotated, take every tile of the square around the circle of
+    // CORRIDOR_RADIUS_METERS. Its corners are sqrt(2) times the radius away
+    auto center = get_tile(lat, lon, z);
+    int x_min = std::get<1>(center), x_max = x_min;
+    int y_min = std::get<2>(center), y_max = y_min;
+    for (float bearing : {45.0f, 135.0f, 225.0f, 315.0f}) {
+      QMapLibre::Coordinate corner = get_point_along_line(lat, lon, bearing, CORRIDOR_RADIUS_METERS * M_SQRT2);
+      auto tile = get_tile(corner.first, corner.second, z);
+      x_min = std::min(x_min, std::get<1>(tile));
+      x_max = std::max(x_max, std::get<1>(tile));
+      y_min = std::min(y_min, std::get<2>(tile));
+      y_max = std::max(y_max, std::get<2>(tile));
+    }
+    for (int y = y_min; y <= y_max; y++) {
+      for (int x = x_min; x <= x_max; x++) {
+        if (tiles.insert({z, x, y}).second) {
+          tile_centers.push_back(get_tile_center({z, x, y}));
+        }
+      }
+    }
+  };
+
+  for (int i = 0; i + 1 < coordinates.size(); i++) {
+    const QGeoCoordinate &a = coordinates[i], &b = coordinates[i + 1];
+    const double dist = a.distanceTo(b);
+    const double bearing = a.azimuthTo(b);
+    for (double d = 0; d < dist; d += CORRIDOR_STEP_METERS) {
+      QMapLibre::Coordinate p = get_point_along_line(a.latitude(), a.longitude(), bearing, d);
+      add_tiles(p.first, p.second);
+    }
+  }
+  if (!coordinates.isEmpty()) {
+    add_tiles(coordinates.back().latitude(), coordinates.back().longitude());
+  }
+
+  LOGD("Prefetching %zu tiles along the route", tile_centers.size());
+  renderNext();
+}
+
+void MapPrefetcher::renderNext() {
+  if (render_pending || next_tile >= tile_centers.size()) {
+    return;
+  }
+
+  QMapLibre::Coordinate center = tile_centers[next_tile++];
+  m_map->setCoordinate(center);
+  m_map->setZoom(get_zoom_level_for_scale(center.first, METERS_PER_PIXEL));
+  render_pending = true;
+  m_map->startStaticRender();
+}
+
+MapRenderer::MapRenderer(const QMapLibre::Settings &settings, bool online) : m_settings(settings), static_render(online) {
+  if (static_render) {
+    m_settings.setMapMode(QMapLibre::Settings::MapMode::Static);
+    m_settings.setCacheDatabasePath(QString::fromStdString(CACHE_PATH));
+    m_settings.setCacheDatabaseMaximumSize(CACHE_SIZE_MAX);
+  }
+
   QSurfaceFormat fmt;
   fmt.setRenderableType(QSurfaceFormat::OpenGLES);
 
@@ -56,9 +214,41 @@ MapRenderer::MapRenderer(const QMapLibre::Settings &settings, bool online) : m_s
   gl_functions.reset(ctx->functions());
   gl_functions->initializeOpenGLFunctions();
 
+  gl_extra_functions = ctx->extraFunctions();
+  gl_extra_functions->initializeOpenGLFunctions();
+
   QOpenGLFramebufferObjectFormat fbo_format;
   fbo.reset(new QOpenGLFramebufferObject(WIDTH, HEIGHT, fbo_format));
 
+  // single channel copy of the map, flipped to top row first, frames are read from here
+  gl_functions->glGenRenderbuffers(1, &grey_rbo);
+  gl_functions->glBindRenderbuffer(GL_RENDERBUFFER, grey_rbo);
+  gl_functions->glRenderbufferStorage(GL_RENDERBUFFER, GL_R8, WIDTH, HEIGHT);
+  gl_functions->glGenFramebuffers(1, &grey_fbo);
+  gl_functions->glBindFramebuffer(GL_FRAMEBUFFER, grey_fbo);
+  gl_functions->glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, grey_rbo);
+  assert(gl_functions->glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+
+  GLint read_format = 0, read_type = 0;
+  gl_functions->glGetIntegerv(GL_IMPLEMENTATION_COLOR_READ_FORMAT, &read_format);
+  gl_functions->glGetIntegerv(GL_IMPLEMENTATION_COLOR_READ_TYPE, &read_type);
+  read_red = read_format == GL_RED && read_type == GL_UNSIGNED_BYTE;
+  if (!read_red) {
+    LOGW("GL_RED reads not supported, reading map frames as RGBA");
+  }
+  fbo->bindDefault();
+
+  for (Readback &rb : readbacks) {
+    gl_functions->glGenBuffers(1, &rb.pbo);
+    gl_functions->glBindBuffer(GL_PIXEL_PACK_BUFFER, rb.pbo);
+    gl_functions->glBufferData(GL_PIXEL_PACK_BUFFER, WIDTH * HEIGHT * (read_red ? 1 : 4), nullptr, GL_STREAM_READ);
+    gl_functions->glGenBuffers(1, &rb.thumbnail_pbo);
+    gl_functions->glBindBuffer(GL_PIXEL_PACK_BUFFER, rb.thumbnail_pbo);
+    gl_functions->glBufferData(GL_PIXEL_PACK_BUFFER, WIDTH * HEIGHT * 4, nullptr, GL_STREAM_READ);
+  }
+  gl_functions->glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  image.resize(WIDTH * HEIGHT);
+
   std::string style = util::read_file(STYLE_PATH);
   m_map.reset(new QMapLibre::Map(nullptr, m_settings, fbo->size(), 1));
   m_map->setCoordinateZoom(QMapLibre::Coordinate(0, 0), DEFAULT_ZOOM);
@@ -87,7 +277,14 @@ MapRenderer::MapRenderer(const QMapLibre::Settings &settings, bool online) : m_s
     LOGE("Map loading failed with %d: '%s'\n", err_code, reason.toStdString().c_str());
   });
 
+  if (static_render) {
+    QObject::connect(m_map.data(), &QMapLibre::Map::needsRendering, this, &MapRenderer::update);
+    QObject::connect(m_map.data(), &QMapLibre::Map::staticRenderFinished, this, &MapRenderer::staticRenderFinished);
+  }
+
   if (online) {
+    prefetcher = std::make_unique<MapPrefetcher>(m_settings, style, fmt);
+
     vipc_server.reset(new VisionIpcServer("navd"));
     vipc_server->create_buffers(VisionStreamType::VISION_STREAM_MAP, NUM_VIPC_BUFFERS, false, WIDTH, HEIGHT);
     vipc_server->start_listener();
@@ -111,23 +308,28 @@ void MapRenderer::msgUpdate() {
     auto orientation = location.getCalibratedOrientationNED();
 
     if ((sm->rcv_frame("liveLocationKalman") % LLK_DECIMATION) == 0) {
-      float bearing = RAD2DEG(orientation.getValue()[2]);
-      updatePosition(get_point_along_line(pos.getValue()[0], pos.getValue()[1], bearing, MAP_OFFSET), bearing);
-
-      // TODO: use the static rendering mode instead
-      // retry render a few times
-      for (int i = 0; i < 5 && !rendered(); i++) {
-        QApplication::processEvents(QEventLoop::AllEvents, 100);
-        update();
-        if (rendered()) {
-          LOGW("rendered after %d retries", i+1);
-          break;
-        }
+      uint64_t location_mono_time = (*sm)["liveLocationKalman"].getLogMonoTime();
+      bool location_valid = (location.getStatus() == cereal::LiveLocationKalman::Status::VALID) && pos.getValid();
+
+      if (render_pending && !render_timed_out && millis_since_boot() - render_start_t > RENDER_TIMEOUT_MS) {
+        // send a blank frame for the stuck position. mbgl rejects a new static render while
+        // this one is in flight, so keep waiting for it and drop its result when it comes
+        LOGW("Static render timed out after %.0f ms", millis_since_boot() - render_start_t);
+        render_timed_out = true;
+        blank_frames++;
+        publish(0, false, render_location_mono_time, render_location_valid);
       }
 
-      // fallback to sending a blank frame
-      if (!rendered()) {
-        publish(0, false);
+      if (render_pending) {
+        // the tiles of the last position are still loading, send a blank frame for this
+        // position and let that render finish instead of starting over
+        blank_frames++;
+        publish(0, false, location_mono_time, location_valid);
+      } else {
+        render_location_mono_time = location_mono_time;
+        render_location_valid = location_valid;
+        float bearing = RAD2DEG(orientation.getValue()[2]);
+        updatePosition(get_point_along_line(pos.getValue()[0], pos.getValue()[1], bearing, MAP_OFFSET), bearing);
       }
     }
   }
@@ -150,14 +352,39 @@ void MapRenderer::updatePosition(QMapLibre::Coordinate position, float bearing)
     return;
   }
 
-  // Choose a scale that ensures above 13 zoom level up to and above 75deg of lat
-  float meters_per_pixel = 2;
-  float zoom = get_zoom_level_for_scale(position.first, meters_per_pixel);
+  float zoom = get_zoom_level_for_scale(position.first, METERS_PER_PIXEL);
 
   m_map->setCoordinate(position);
   m_map->setBearing(bearing);
   m_map->setZoom(zoom);
-  update();
+
+  if (static_render) {
+    render_pending = true;
+    render_start_t = millis_since_boot();
+    m_map->startStaticRender();
+  } else {
+    update();
+  }
+}
+
+void MapRenderer::staticRenderFinished(const QString &error) {
+  render_pending = false;
+  if (render_timed_out) {
+    // a blank frame was already sent for this position
+    LOGW("Dropping static render finished after %.0f ms", millis_since_boot() - render_start_t);
+    render_timed_out = false;
+    return;
+  }
+  if (!error.isEmpty()) {
+    LOGE("Static render failed: '%s'", error.toStdString().c_str());
+    blank_frames++;
+    publish(0, false, render_location_mono_time, render_location_valid);
+    return;
+  }
+
+  render_latency = (millis_since_boot() - render_start_t) / 1000.0;
+  render_latency_hist[std::min<size_t>(render_latency * 1000.0 / RENDER_LATENCY_BIN_MS, render_latency_hist.size() - 1)]++;
+  publish(last_render_time, true, render_location_mono_time, render_location_valid);
 }
 
 bool MapRenderer::loaded() {
@@ -169,12 +396,7 @@ void MapRenderer::update() {
   gl_functions->glClear(GL_COLOR_BUFFER_BIT);
   m_map->render();
   gl_functions->glFlush();
-  double end_t = millis_since_boot();
-
-  if ((vipc_server != nullptr) && loaded()) {
-    publish((end_t - start_t) / 1000.0, true);
-    last_llk_rendered = (*sm)["liveLocationKalman"].getLogMonoTime();
-  }
+  last_render_time = (millis_since_boot() - start_t) / 1000.0;
 }
 
 void MapRenderer::sendThumbnail(const uint64_t ts, const kj::Array<capnp::byte> &buf) {
@@ -186,39 +408,147 @@ void MapRenderer::sendThumbnail(const uint64_t ts, const kj::Array<capnp::byte>
   pm->send("navThumbnail", msg);
 }
 
-void MapRenderer::publish(const double render_time, const bool loaded) {
-  QImage cap = fbo->toImage().convertToFormat(QImage::Format_RGB888, Qt::AutoColor);
+// Red channel of RGBA pixels. Byte 0 of every little endian word is red, so the loop is
+// a plain narrowing the compiler turns into SIMD.
+static void rgba_to_grey(const uint32_t *src, uint8_t *dst, int n) {
+  for (int i = 0; i < n; i++) {
+    dst[i] = src[i] & 0xff;
+  }
+}
+
+// starts reading the FBO into pbo, the copy runs asynchronously. The map is blitted
+// into the R8 framebuffer first, which also flips it to top row first
+void MapRenderer::startReadback(GLuint pbo) {
+  gl_functions->glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo->handle());
+  gl_functions->glBindFramebuffer(GL_DRAW_FRAMEBUFFER, grey_fbo);
+  gl_extra_functions->glBlitFramebuffer(0, 0, WIDTH, HEIGHT, 0, HEIGHT, WIDTH, 0, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+
+  gl_functions->glBindFramebuffer(GL_READ_FRAMEBUFFER, grey_fbo);
+  gl_functions->glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+  gl_functions->glReadPixels(0, 0, WIDTH, HEIGHT, read_red ? GL_RED : GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+  gl_functions->glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  fbo->bindDefault();
+}
+
+// greyscale image in pbo to dst
+void MapRenderer::readGrey(GLuint pbo, uint8_t *dst) {
+  gl_functions->glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+  const void *src = gl_extra_functions->glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, WIDTH * HEIGHT * (read_red ? 1 : 4), GL_MAP_READ_BIT);
+  assert(src != nullptr);
+  if (read_red) {
+    memcpy(dst, src, WIDTH * HEIGHT);
+  } else {
+    rgba_to_grey((const uint32_t *)src, dst, WIDTH * HEIGHT);
+  }
+  gl_extra_functions->glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+  gl_functions->glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+// starts reading the colour map into pbo, for the thumbnail
+void MapRenderer::startThumbnailReadback(GLuint pbo) {
+  fbo->bind();
+  gl_functions->glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+  gl_functions->glReadPixels(0, 0, WIDTH, HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+  gl_functions->glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  fbo->bindDefault();
+}
+
+// RGB888 thumbnail from the colour map in pbo, top row first
+QImage MapRenderer::readThumbnail(GLuint pbo) {
+  gl_functions->glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+  const uchar *src = (const uchar *)gl_extra_functions->glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, WIDTH * HEIGHT * 4, GL_MAP_READ_BIT);
+  assert(src != nullptr);
+  // GL rows are bottom to top, mirrored() copies out of the mapped buffer
+  QImage thumbnail = QImage(src, WIDTH, HEIGHT, QImage::Format_RGBA8888).mirrored().convertToFormat(QImage::Format_RGB888, Qt::AutoColor);
+  gl_extra_functions->glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+  gl_functions->glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  return thumbnail;
+}
+
+void MapRenderer::publish(const double render_time, const bool loaded, const uint64_t location_mono_time, const bool location_valid) {
+  // both buffers in flight, send the older frame first
+  Readback &rb = readbacks[readback_idx];
+  if (rb.pending && !finishReadback(rb, READBACK_TIMEOUT_NS)) {
+    LOGE("Map frame readback timed out, dropping it");
+    dropReadback(rb);
+  }
+
+  startReadback(rb.pbo);
+  rb.pending = true;
+  rb.render_time = render_time;
+  rb.render_latency = loaded ? render_latency : 0;
+  rb.loaded = loaded;
+  rb.location_mono_time = location_mono_time;
+  rb.location_valid = location_valid;
+  // the thumbnail is read now, the FBO may be rendered again before the frame is sent,
+  // which is after the frame still pending in the other buffer
+  const uint32_t rb_frame_id = frame_id + (readbacks[readback_idx ^ 1].pending ? 1 : 0);
+  rb.send_thumbnail = TEST_MODE || rb_frame_id % 100 == 0;
+  if (rb.send_thumbnail) {
+    startThumbnailReadback(rb.thumbnail_pbo);
+  }
+  rb.fence = gl_extra_functions->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  gl_functions->glFlush();
+
+  readback_idx ^= 1;
+  QTimer::singleShot(0, this, &MapRenderer::finishReadbacks);
+}
+
+void MapRenderer::finishReadbacks() {
+  // readback_idx is the older of the two, frames are sent in order
+  for (size_t i = 0; i < readbacks.size(); i++) {
+    Readback &rb = readbacks[(readback_idx + i) % readbacks.size()];
+    if (rb.pending && !finishReadback(rb, 0)) {
+      // copy not done yet, check again without blocking the event loop
+      QTimer::singleShot(1, this, &MapRenderer::finishReadbacks);
+      return;
+    }
+  }
+}
+
+void MapRenderer::dropReadback(Readback &rb) {
+  gl_extra_functions->glDeleteSync(rb.fence);
+  rb.fence = nullptr;
+  rb.pending = false;
+}
+
+// sends the frame of rb once its copy finished, returns false if that takes longer than timeout_ns
+bool MapRenderer::finishReadback(Readback &rb, GLuint64 timeout_ns) {
+  GLenum wait = gl_extra_functions->glClientWaitSync(rb.fence, GL_SYNC_FLUSH_COMMANDS_BIT, timeout_ns);
+  if (wait == GL_TIMEOUT_EXPIRED) {
+    return false;
+  }
+  dropReadback(rb);
+  if (wait == GL_WAIT_FAILED) {
+    LOGE("Waiting for the map frame readback failed, dropping it");
+    return true;
+  }
 
-  auto location = (*sm)["liveLocationKalman"].getLiveLocationKalman();
-  bool valid = loaded && (location.getStatus() == cereal::LiveLocationKalman::Status::VALID) && location.getPositionGeodetic().getValid();
-  ever_loaded = ever_loaded || loaded;
+  bool valid = rb.loaded && rb.location_valid;
+  ever_loaded = ever_loaded || rb.loaded;
   uint64_t ts = nanos_since_boot();
   VisionBuf* buf = vipc_server->get_buffer(VisionStreamType::VISION_STREAM_MAP);
   VisionIpcBufExtra extra = {
     .frame_id = frame_id,
-    .timestamp_sof = (*sm)["liveLocationKalman"].getLogMonoTime(),
+    .timestamp_sof = rb.location_mono_time,
     .timestamp_eof = ts,
     .valid = valid,
   };
 
-  assert(cap.sizeInBytes() >= buf->len);
+  assert(buf->len >= WIDTH * HEIGHT);
   uint8_t* dst = (uint8_t*)buf->addr;
-  uint8_t* src = cap.bits();
-
-  // RGB to greyscale
-  memset(dst, 128, buf->len);
-  for (int i = 0; i < WIDTH * HEIGHT; i++) {
-    dst[i] = src[i * 3];
-  }
+  readGrey(rb.pbo, dst);
+  memset(dst + WIDTH * HEIGHT, 128, buf->len - WIDTH * HEIGHT);
 
   vipc_server->send(buf, &extra);
 
   // Send thumbnail
+  const QImage cap = rb.send_thumbnail ? readThumbnail(rb.thumbnail_pbo) : QImage();
   if (TEST_MODE) {
     // Full image in thumbnails in test mode
     kj::Array<capnp::byte> buffer_kj = kj::heapArray<capnp::byte>((const capnp::byte*)cap.bits(), cap.sizeInBytes());
     sendThumbnail(ts, buffer_kj);
-  } else if (frame_id % 100 == 0) {
+  } else if (!cap.isNull()) {
     // Write jpeg into buffer
     QByteArray buffer_bytes;
     QBuffer buffer(&buffer_bytes);
@@ -234,26 +564,51 @@ void MapRenderer::publish(const double render_time, const bool loaded) {
   auto evt = msg.initEvent();
   auto state = evt.initMapRenderState();
   evt.setValid(valid);
-  state.setLocationMonoTime((*sm)["liveLocationKalman"].getLogMonoTime());
-  state.setRenderTime(render_time);
+  state.setLocationMonoTime(rb.location_mono_time);
+  state.setRenderTime(rb.render_time);
   state.setFrameId(frame_id);
+  state.setRenderLatency(rb.render_latency);
+  state.setRenderLatencyHistogram(kj::ArrayPtr<const uint32_t>(render_latency_hist.data(), render_latency_hist.size()));
+  state.setBlankFrames(blank_frames);
   pm->send("mapRenderState", msg);
 
   frame_id++;
+  return true;
 }
 
+// the image is reused by the next call
 uint8_t* MapRenderer::getImage() {
-  QImage cap = fbo->toImage().convertToFormat(QImage::Format_RGB888, Qt::AutoColor);
+  startReadback(readbacks[0].pbo);
+  readGrey(readbacks[0].pbo, image.data());
+  return image.data();
+}
 
-  uint8_t* src = cap.bits();
-  uint8_t* dst = new uint8_t[WIDTH * HEIGHT];
+// Renders a frame for each (lat, lon, bearing) of poses into out, WIDTH * HEIGHT bytes per
+// frame, waiting up to timeout seconds per frame for its tiles. A frame is read back while
+// the next one renders. Returns the number of frames that were fully loaded.
+int MapRenderer::renderBatch(const float *poses, int n, uint8_t *out, float timeout) {
+  int loaded_frames = 0;
+  for (int i = 0; i < n; i++) {
+    const float *pose = poses + 3 * i;
+    updatePosition({pose[0], pose[1]}, pose[2]);
+
+    double start_t = millis_since_boot();
+    while (!loaded() && millis_since_boot() - start_t < timeout * 1000) {
+      // The main qt app is not execed, tile requests need the event loop
+      QApplication::processEvents(QEventLoop::AllEvents, 10);
+      update();
+    }
+    loaded_frames += loaded();
 
-  // RGB to greyscale
-  for (int i = 0; i < WIDTH * HEIGHT; i++) {
-    dst[i] = src[i * 3];
+    if (i > 0) {
+      readGrey(readbacks[(i - 1) % 2].pbo, out + (size_t)(i - 1) * WIDTH * HEIGHT);
+    }
+    startReadback(readbacks[i % 2].pbo);
   }
-
-  return dst;
+  if (n > 0) {
+    readGrey(readbacks[(n - 1) % 2].pbo, out + (size_t)(n - 1) * WIDTH * HEIGHT);
+  }
+  return loaded_frames;
 }
 
 void MapRenderer::updateRoute(QList<QGeoCoordinate> coordinates) {
@@ -267,6 +622,10 @@ void MapRenderer::updateRoute(QList<QGeoCoordinate> coordinates) {
   navSource["data"] = QVariant::fromValue<QMapLibre::Feature>(feature);
   m_map->updateSource("navSource", navSource);
   m_map->setLayoutProperty("navLayer", "visibility", "visible");
+
+  if (prefetcher) {
+    prefetcher->updateRoute(coordinates);
+  }
 }
 
 void MapRenderer::initLayers() {
@@ -283,6 +642,15 @@ void MapRenderer::initLayers() {
 }
 
 MapRenderer::~MapRenderer() {
+  for (Readback &rb : readbacks) {
+    if (rb.fence != nullptr) {
+      gl_extra_functions->glDeleteSync(rb.fence);
+    }
+    gl_functions->glDeleteBuffers(1, &rb.pbo);
+    gl_functions->glDeleteBuffers(1, &rb.thumbnail_pbo);
+  }
+  gl_functions->glDeleteFramebuffers(1, &grey_fbo);
+  gl_functions->glDeleteRenderbuffers(1, &grey_rbo);
 }
 
 extern "C" {
@@ -328,7 +696,14 @@ extern "C" {
     return inst->getImage();
   }
 
+  int map_renderer_render_batch(MapRenderer *inst, const float *poses, int n, char *polyline, uint8_t *out, float timeout) {
+    if (polyline != nullptr) {
+      inst->updateRoute(polyline_to_coordinate_list(QString::fromUtf8(polyline)));
+    }
+    return inst->renderBatch(poses, n, out, timeout);
+  }
+
   void map_renderer_free_image(MapRenderer *inst, uint8_t * buf) {
-    delete[] buf;
+    // the image belongs to the renderer
   }
 }
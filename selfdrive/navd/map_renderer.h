@@ -1,6 +1,11 @@
 #pragma once
 
+#include <array>
 #include <memory>
+#include <set>
+#include <string>
+#include <tuple>
+#include <vector>
 
 #include <QOpenGLContext>
 #include <QMapLibre/Map>
@@ -10,18 +15,43 @@
 #include <QOpenGLBuffer>
 #include <QOffscreenSurface>
 #include <QOpenGLFunctions>
+#include <QOpenGLExtraFunctions>
 #include <QOpenGLFramebufferObject>
 
 #include "msgq/visionipc/visionipc_server.h"
 #include "cereal/messaging/messaging.h"
 
 
+// Warms the map cache database along the route. Its own map renders, in static mode, one
+// view centred on every tile the route corridor touches at the render zoom, in route order,
+// which loads those tiles into the cache database the renderer's map shares. It renders
+// in its own GL context, one view at a time with a pause between them.
+class MapPrefetcher {
+public:
+  MapPrefetcher(const QMapLibre::Settings &settings, const std::string &style, const QSurfaceFormat &format);
+  ~MapPrefetcher();
+  void updateRoute(const QList<QGeoCoordinate> &coordinates);
+
+private:
+  void renderNext();
+
+  std::unique_ptr<QOpenGLContext> ctx;
+  std::unique_ptr<QOffscreenSurface> surface;
+  std::unique_ptr<QOpenGLFramebufferObject> fbo;
+  QScopedPointer<QMapLibre::Map> m_map;
+
+  std::vector<QMapLibre::Coordinate> tile_centers;
+  size_t next_tile = 0;
+  bool render_pending = false;
+};
+
 class MapRenderer : public QObject {
   Q_OBJECT
 
 public:
   MapRenderer(const QMapLibre::Settings &, bool online=true);
   uint8_t* getImage();
+  int renderBatch(const float *poses, int n, uint8_t *out, float timeout);
   void update();
   bool loaded();
   ~MapRenderer();
@@ -31,23 +61,64 @@ private:
   std::unique_ptr<QOffscreenSurface> surface;
   std::unique_ptr<QOpenGLFunctions> gl_functions;
   std::unique_ptr<QOpenGLFramebufferObject> fbo;
+  QOpenGLExtraFunctions *gl_extra_functions;
+
+  // The frame is read into one of two pixel buffer objects without waiting for the GPU and
+  // sent from the event loop once the copy finished, so a second frame can be read meanwhile
+  struct Readback {
+    GLuint pbo = 0;
+    GLuint thumbnail_pbo = 0;
+    GLsync fence = nullptr;
+    bool pending = false;
+    double render_time;
+    double render_latency;
+    bool loaded;
+    uint64_t location_mono_time;
+    bool location_valid;
+    bool send_thumbnail;
+  };
+  std::array<Readback, 2> readbacks;
+  int readback_idx = 0;
+  // R8 copy of the map frames are read from, red only if the implementation can read
+  // that directly, else RGBA
+  GLuint grey_fbo = 0;
+  GLuint grey_rbo = 0;
+  bool read_red = false;
+  std::vector<uint8_t> image;
+  void startReadback(GLuint pbo);
+  void readGrey(GLuint pbo, uint8_t *dst);
+  void startThumbnailReadback(GLuint pbo);
+  QImage readThumbnail(GLuint pbo);
+  bool finishReadback(Readback &rb, GLuint64 timeout_ns);
+  void dropReadback(Readback &rb);
+  void finishReadbacks();
 
   std::unique_ptr<VisionIpcServer> vipc_server;
   std::unique_ptr<PubMaster> pm;
   std::unique_ptr<SubMaster> sm;
-  void publish(const double render_time, const bool loaded);
+  void publish(const double render_time, const bool loaded, const uint64_t location_mono_time, const bool location_valid);
   void sendThumbnail(const uint64_t ts, const kj::Array<capnp::byte> &buf);
 
   QMapLibre::Settings m_settings;
   QScopedPointer<QMapLibre::Map> m_map;
+  std::unique_ptr<MapPrefetcher> prefetcher;
 
   void initLayers();
 
   uint32_t frame_id = 0;
-  uint64_t last_llk_rendered = 0;
-  bool rendered() {
-    return last_llk_rendered == (*sm)["liveLocationKalman"].getLogMonoTime();
-  }
+  double last_render_time = 0;
+
+  // Online the map is rendered in static mode: a position update starts a render that
+  // loads all tiles first, and the frame is published once staticRenderFinished fires
+  bool static_render;
+  bool render_pending = false;
+  bool render_timed_out = false;
+  double render_start_t = 0;
+  double render_latency = 0;
+  uint64_t render_location_mono_time = 0;
+  bool render_location_valid = false;
+  std::array<uint32_t, 21> render_latency_hist = {};  // renderLatencyHistogram of mapRenderState
+  uint32_t blank_frames = 0;
 
   QTimer* timer;
   bool ever_loaded = false;
@@ -56,4 +127,5 @@ public slots:
   void updatePosition(QMapLibre::Coordinate position, float bearing);
   void updateRoute(QList<QGeoCoordinate> coordinates);
   void msgUpdate();
+  void staticRenderFinished(const QString &error);
 };
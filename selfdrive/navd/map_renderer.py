@@ -27,6 +27,7 @@ void map_renderer_process(void *inst);
 bool map_renderer_loaded(void *inst);
 uint8_t* map_renderer_get_image(void *inst);
 void map_renderer_free_image(void *inst, uint8_t *buf);
+int map_renderer_render_batch(void *inst, const float *poses, int n, char *polyline, uint8_t *out, float timeout);
 """)
   return ffi, ffi.dlopen(lib)
 
@@ -55,6 +56,17 @@ def get_image(lib, renderer):
   return r.reshape((WIDTH, HEIGHT))
 
 
+def render_batch(ffi, lib, renderer, poses, route=None, timeout=10.):
+  """Renders an image for each (lat, lon, bearing) in poses, optionally along route, an encoded polyline.
+  Returns the images, shape (len(poses), HEIGHT, WIDTH), and how many of them were fully loaded."""
+  poses = np.ascontiguousarray(poses, dtype=np.float32).reshape(-1, 3)
+  out = np.empty((len(poses), HEIGHT, WIDTH), dtype=np.uint8)
+  route_c = ffi.NULL if route is None else route.encode()
+  loaded = lib.map_renderer_render_batch(renderer, ffi.from_buffer("float[]", poses), len(poses), route_c,
+                                         ffi.from_buffer("uint8_t[]", out), timeout)
+  return out, loaded
+
+
 def navRoute_to_polyline(nr):
   coords = [(m.latitude, m.longitude) for m in nr.navRoute.coordinates]
   return coords_to_polyline(coords)
@@ -56,43 +56,100 @@ float get_k(float a, float b, float c, float d) {
   return 2.0 - (fabs(a - b) + fabs(c - d));
 }
 
-__kernel void process_raw(const __global uchar * in, __global uchar * out, int expo_time)
-{
-  const int gid_x = get_global_id(0);
-  const int gid_y = get_global_id(1);
+#if defined(ISP_LUTS)
+// Instead of evaluating them per pixel, the vignetting correction is read from an image
+// with a factor per work item, baked once by bake_vignetting, and the gamma curve and the
+// HDR combine of the exposure time the frame was taken with from tables baked by
+// bake_isp_lut, which is only rerun when the exposure time changes.
+//
+// Gamma is tabulated at 2^GAMMA_LUT_BITS points per octave from 2^GAMMA_LUT_MIN_EXP to 2
+// and interpolated linearly in between. The octave and position in it are read from the
+// float bits, so a lookup needs no log. Below the first point it goes linearly to 0.
+#define GAMMA_LUT_BITS 6
+#define GAMMA_LUT_MIN_EXP -16
+#define GAMMA_LUT_SIZE ((1 - GAMMA_LUT_MIN_EXP) * (1 << GAMMA_LUT_BITS) + 2)
+#define GAMMA_LUT_FRAC_BITS (23 - GAMMA_LUT_BITS)
+// the HDR combine takes the long exposure table entry for the long exposure value, or the
+// short exposure table entry for the short one if the long one is negative
+#define HDR_LUT_OFFSET GAMMA_LUT_SIZE
+#if BIT_DEPTH == 10
+  #define ISP_LUT_SIZE (GAMMA_LUT_SIZE + 2 * (1 << BIT_DEPTH))
+#else
+  #define ISP_LUT_SIZE GAMMA_LUT_SIZE
+#endif
 
-  // estimate vignetting
-  #if VIGNETTING
-    int gx = (gid_x*2 - RGB_WIDTH/2);
-    int gy = (gid_y*2 - RGB_HEIGHT/2);
-    const float vignette_factor = get_vignetting_s((gx*gx + gy*gy) / VIGNETTE_RSZ);
-  #else
-    const float vignette_factor = 1.0;
-  #endif
+#define ISP_LUT_ARGS , const __global float * vignetting, const __global float * isp_lut
+#define ISP_LUT_PARAMS , vignetting, isp_lut
+#define APPLY_GAMMA(rgb, expo_time) apply_gamma_lut(rgb, isp_lut)
+#define NORMALIZE_PV_HDR(parsed, short_parsed, vignette_factor, expo_time) normalize_pv_hdr_lut(parsed, short_parsed, vignette_factor, isp_lut + HDR_LUT_OFFSET)
 
-  const int row_before_offset = (gid_y == 0) ? 2 : 0;
-  const int row_after_offset = (gid_y == (RGB_HEIGHT/2 - 1)) ? 1 : 3;
+float gamma_lut_x(int i) {
+  return as_float((uint)(i + ((127 + GAMMA_LUT_MIN_EXP) << GAMMA_LUT_BITS)) << GAMMA_LUT_FRAC_BITS);
+}
 
-  float3 rgb_tmp;
-  uchar3 rgb_out[4]; // output is 2x2 window
+float gamma_lut(float x, const __global float * lut) {
+  const float x_min = gamma_lut_x(0);
+  if (x < x_min) {
+    return lut[0] * fmax(x, 0.0f) / x_min;
+  }
+  // clamped on the bits, so anything past 2 (or NaN) stays in the table
+  const uint u = min(as_uint(x) - as_uint(x_min), (uint)(GAMMA_LUT_SIZE - 2) << GAMMA_LUT_FRAC_BITS);
+  const int i = u >> GAMMA_LUT_FRAC_BITS;
+  return mix(lut[i], lut[i + 1], (u & ((1 << GAMMA_LUT_FRAC_BITS) - 1)) * (1.0f / (1 << GAMMA_LUT_FRAC_BITS)));
+}
 
-  // read offset
-  int start_idx;
+float3 apply_gamma_lut(float3 rgb, const __global float * lut) {
+  return (float3)(gamma_lut(rgb.x, lut), gamma_lut(rgb.y, lut), gamma_lut(rgb.z, lut));
+}
+
+#if BIT_DEPTH == 10
+float hdr_lut(int lv, int sv, const __global float * lut) {
+  const float pv = lut[lv];
+  return pv >= 0 ? pv : lut[(1 << BIT_DEPTH) + sv];
+}
+
+float4 normalize_pv_hdr_lut(int4 parsed, int4 short_parsed, float vignette_factor, const __global float * lut) {
+  float4 pv;
+  pv.s0 = hdr_lut(parsed.s0, short_parsed.s0, lut);
+  pv.s1 = hdr_lut(parsed.s1, short_parsed.s1, lut);
+  pv.s2 = hdr_lut(parsed.s2, short_parsed.s2, lut);
+  pv.s3 = hdr_lut(parsed.s3, short_parsed.s3, lut);
+  return clamp(pv*vignette_factor, 0.0, 1.0);
+}
+#endif
+#else
+#define ISP_LUT_ARGS
+#define ISP_LUT_PARAMS
+#define APPLY_GAMMA(rgb, expo_time) apply_gamma(rgb, expo_time)
+#define NORMALIZE_PV_HDR(parsed, short_parsed, vignette_factor, expo_time) normalize_pv_hdr(parsed, short_parsed, vignette_factor, expo_time)
+#endif
+
+// first of the 8 bytes, 9 for unaligned 10-bit, a work item reads from each of its rows
+int window_col(int gid_x) {
   #if BIT_DEPTH == 10
-    bool aligned10;
     if (gid_x % 2 == 0) {
-      aligned10 = true;
-      start_idx = (2 * gid_y - 1) * FRAME_STRIDE + (5 * gid_x / 2 - 2) + (FRAME_STRIDE * FRAME_OFFSET);
+      return 5 * gid_x / 2 - 2;
     } else {
-      aligned10 = false;
-      start_idx = (2 * gid_y - 1) * FRAME_STRIDE + (5 * (gid_x - 1) / 2 + 1) + (FRAME_STRIDE * FRAME_OFFSET);
+      return 5 * (gid_x - 1) / 2 + 1;
     }
   #else
-    start_idx = (2 * gid_y - 1) * FRAME_STRIDE + (3 * gid_x - 2) + (FRAME_STRIDE * FRAME_OFFSET);
+    return 3 * gid_x - 2;
   #endif
+}
+
+// reads the 4 raw rows around the 2x2 window of work item (gid_x, gid_y)
+void read_window(const __global uchar * in, int gid_x, int gid_y, uchar8 * dat, uchar * extra_dat, uchar8 * short_dat, uchar * short_extra_dat)
+{
+  const int row_before_offset = (gid_y == 0) ? 2 : 0;
+  const int row_after_offset = (gid_y == (RGB_HEIGHT/2 - 1)) ? 1 : 3;
+  #if BIT_DEPTH == 10
+    const bool aligned10 = gid_x % 2 == 0;
+  #endif
+
+  // read offset
+  const int start_idx = (2 * gid_y - 1) * FRAME_STRIDE + window_col(gid_x) + (FRAME_STRIDE * FRAME_OFFSET);
 
   // read in 4 rows, 8 uchars each
-  uchar8 dat[4];
   // row_before
   dat[0] = vload8(0, in + start_idx + FRAME_STRIDE*row_before_offset);
   // row_0
@@ -109,7 +166,6 @@ __kernel void process_raw(const __global uchar * in, __global uchar * out, int e
   dat[3] = vload8(0, in + start_idx + FRAME_STRIDE*row_after_offset);
   // need extra bit for 10-bit, 4 rows, 1 uchar each
   #if BIT_DEPTH == 10
-    uchar extra_dat[4];
     if (!aligned10) {
       extra_dat[0] = in[start_idx + FRAME_STRIDE*row_before_offset + 8];
       extra_dat[1] = in[start_idx + FRAME_STRIDE*1 + 8];
@@ -120,13 +176,11 @@ __kernel void process_raw(const __global uchar * in, __global uchar * out, int e
 
   // read odd rows for staggered second exposure
   #if HDR_OFFSET > 0
-    uchar8 short_dat[4];
     short_dat[0] = vload8(0, in + start_idx + FRAME_STRIDE*(row_before_offset+HDR_OFFSET/2) + FRAME_STRIDE/2);
     short_dat[1] = vload8(0, in + start_idx + FRAME_STRIDE*(1+HDR_OFFSET/2) + FRAME_STRIDE/2);
     short_dat[2] = vload8(0, in + start_idx + FRAME_STRIDE*(2+HDR_OFFSET/2) + FRAME_STRIDE/2);
     short_dat[3] = vload8(0, in + start_idx + FRAME_STRIDE*(row_after_offset+HDR_OFFSET/2) + FRAME_STRIDE/2);
     #if BIT_DEPTH == 10
-      uchar short_extra_dat[4];
       if (!aligned10) {
         short_extra_dat[0] = in[start_idx + FRAME_STRIDE*(row_before_offset+HDR_OFFSET/2) + FRAME_STRIDE/2 + 8];
         short_extra_dat[1] = in[start_idx + FRAME_STRIDE*(1+HDR_OFFSET/2) + FRAME_STRIDE/2 + 8];
@@ -135,6 +189,27 @@ __kernel void process_raw(const __global uchar * in, __global uchar * out, int e
       }
     #endif
   #endif
+}
+
+// parses the raw rows of work item (gid_x, gid_y) and debayers them into its 2x2 window
+void debayer_2x2(const uchar8 * dat, const uchar * extra_dat, const uchar8 * short_dat, const uchar * short_extra_dat,
+                 int expo_time, int gid_x, int gid_y, uchar3 * rgb_out ISP_LUT_ARGS)
+{
+  // estimate vignetting
+  #if VIGNETTING && defined(ISP_LUTS)
+    const float vignette_factor = vignetting[mad24(gid_y, RGB_WIDTH/2, gid_x)];
+  #elif VIGNETTING
+    int gx = (gid_x*2 - RGB_WIDTH/2);
+    int gy = (gid_y*2 - RGB_HEIGHT/2);
+    const float vignette_factor = get_vignetting_s((gx*gx + gy*gy) / VIGNETTE_RSZ);
+  #else
+    const float vignette_factor = 1.0;
+  #endif
+
+  #if BIT_DEPTH == 10
+    const bool aligned10 = gid_x % 2 == 0;
+  #endif
+  float3 rgb_tmp;
 
   // parse into floats 0.0-1.0
   float4 v_rows[4];
@@ -142,16 +217,16 @@ __kernel void process_raw(const __global uchar * in, __global uchar * out, int e
     // for now it's always HDR
     int4 parsed = parse_10bit(dat[0], extra_dat[0], aligned10);
     int4 short_parsed = parse_10bit(short_dat[0], short_extra_dat[0], aligned10);
-    v_rows[ROW_READ_ORDER[0]] = normalize_pv_hdr(parsed, short_parsed, vignette_factor, expo_time);
+    v_rows[ROW_READ_ORDER[0]] = NORMALIZE_PV_HDR(parsed, short_parsed, vignette_factor, expo_time);
     parsed = parse_10bit(dat[1], extra_dat[1], aligned10);
     short_parsed = parse_10bit(short_dat[1], short_extra_dat[1], aligned10);
-    v_rows[ROW_READ_ORDER[1]] = normalize_pv_hdr(parsed, short_parsed, vignette_factor, expo_time);
+    v_rows[ROW_READ_ORDER[1]] = NORMALIZE_PV_HDR(parsed, short_parsed, vignette_factor, expo_time);
     parsed = parse_10bit(dat[2], extra_dat[2], aligned10);
     short_parsed = parse_10bit(short_dat[2], short_extra_dat[2], aligned10);
-    v_rows[ROW_READ_ORDER[2]] = normalize_pv_hdr(parsed, short_parsed, vignette_factor, expo_time);
+    v_rows[ROW_READ_ORDER[2]] = NORMALIZE_PV_HDR(parsed, short_parsed, vignette_factor, expo_time);
     parsed = parse_10bit(dat[3], extra_dat[3], aligned10);
     short_parsed = parse_10bit(short_dat[3], short_extra_dat[3], aligned10);
-    v_rows[ROW_READ_ORDER[3]] = normalize_pv_hdr(parsed, short_parsed, vignette_factor, expo_time);
+    v_rows[ROW_READ_ORDER[3]] = NORMALIZE_PV_HDR(parsed, short_parsed, vignette_factor, expo_time);
   #else
     // no HDR here
     int4 parsed = parse_12bit(dat[0]);
@@ -186,7 +261,7 @@ __kernel void process_raw(const __global uchar * in, __global uchar * out, int e
   rgb_tmp.x = (k02*v_rows[1].s2+k04*v_rows[1].s0)/(k02+k04); // R_G1
   rgb_tmp.y = v_rows[1].s1; // G1(R)
   rgb_tmp.z = (k01*v_rows[0].s1+k03*v_rows[2].s1)/(k01+k03); // B_G1
-  rgb_out[RGB_WRITE_ORDER[0]] = convert_uchar3_sat(apply_gamma(color_correct(clamp(rgb_tmp, 0.0, 1.0)), expo_time) * 255.0);
+  rgb_out[RGB_WRITE_ORDER[0]] = convert_uchar3_sat(APPLY_GAMMA(color_correct(clamp(rgb_tmp, 0.0, 1.0)), expo_time) * 255.0);
 
   const float k11 = get_k(v_rows[0].s1, v_rows[2].s1, v_rows[0].s3, v_rows[2].s3);
   const float k12 = get_k(v_rows[0].s2, v_rows[1].s1, v_rows[1].s3, v_rows[2].s2);
@@ -195,7 +270,7 @@ __kernel void process_raw(const __global uchar * in, __global uchar * out, int e
   rgb_tmp.x = v_rows[1].s2; // R
   rgb_tmp.y = (k11*(v_rows[0].s2+v_rows[2].s2)*0.5+k13*(v_rows[1].s3+v_rows[1].s1)*0.5)/(k11+k13); // G_R
   rgb_tmp.z = (k12*(v_rows[0].s3+v_rows[2].s1)*0.5+k14*(v_rows[0].s1+v_rows[2].s3)*0.5)/(k12+k14); // B_R
-  rgb_out[RGB_WRITE_ORDER[1]] = convert_uchar3_sat(apply_gamma(color_correct(clamp(rgb_tmp, 0.0, 1.0)), expo_time) * 255.0);
+  rgb_out[RGB_WRITE_ORDER[1]] = convert_uchar3_sat(APPLY_GAMMA(color_correct(clamp(rgb_tmp, 0.0, 1.0)), expo_time) * 255.0);
 
   const float k21 = get_k(v_rows[1].s0, v_rows[3].s0, v_rows[1].s2, v_rows[3].s2);
   const float k22 = get_k(v_rows[1].s1, v_rows[2].s0, v_rows[2].s2, v_rows[3].s1);
@@ -204,7 +279,7 @@ __kernel void process_raw(const __global uchar * in, __global uchar * out, int e
   rgb_tmp.x = (k22*(v_rows[1].s2+v_rows[3].s0)*0.5+k24*(v_rows[1].s0+v_rows[3].s2)*0.5)/(k22+k24); // R_B
   rgb_tmp.y = (k21*(v_rows[1].s1+v_rows[3].s1)*0.5+k23*(v_rows[2].s2+v_rows[2].s0)*0.5)/(k21+k23); // G_B
   rgb_tmp.z = v_rows[2].s1; // B
-  rgb_out[RGB_WRITE_ORDER[2]] = convert_uchar3_sat(apply_gamma(color_correct(clamp(rgb_tmp, 0.0, 1.0)), expo_time) * 255.0);
+  rgb_out[RGB_WRITE_ORDER[2]] = convert_uchar3_sat(APPLY_GAMMA(color_correct(clamp(rgb_tmp, 0.0, 1.0)), expo_time) * 255.0);
 
   const float k31 = get_k(v_rows[1].s1, v_rows[2].s2, v_rows[1].s3, v_rows[2].s2);
   const float k32 = get_k(v_rows[1].s3, v_rows[2].s2, v_rows[3].s3, v_rows[2].s2);
@@ -213,9 +288,12 @@ __kernel void process_raw(const __global uchar * in, __global uchar * out, int e
   rgb_tmp.x = (k31*v_rows[1].s2+k33*v_rows[3].s2)/(k31+k33); // R_G2
   rgb_tmp.y = v_rows[2].s2; // G2(B)
   rgb_tmp.z = (k32*v_rows[2].s3+k34*v_rows[2].s1)/(k32+k34); // B_G2
-  rgb_out[RGB_WRITE_ORDER[3]] = convert_uchar3_sat(apply_gamma(color_correct(clamp(rgb_tmp, 0.0, 1.0)), expo_time) * 255.0);
+  rgb_out[RGB_WRITE_ORDER[3]] = convert_uchar3_sat(APPLY_GAMMA(color_correct(clamp(rgb_tmp, 0.0, 1.0)), expo_time) * 255.0);
+}
 
-  // rgb2yuv(nv12)
+// writes the 2x2 window of work item (gid_x, gid_y) to the nv12 image in out
+void rgb2yuv_2x2(__global uchar * out, int gid_x, int gid_y, const uchar3 * rgb_out)
+{
   uchar2 yy = (uchar2)(
     RGB_TO_Y(rgb_out[0].s0, rgb_out[0].s1, rgb_out[0].s2),
     RGB_TO_Y(rgb_out[1].s0, rgb_out[1].s1, rgb_out[1].s2)
@@ -236,3 +314,269 @@ __kernel void process_raw(const __global uchar * in, __global uchar * out, int e
   );
   vstore2(uv, 0, out + UV_OFFSET + mad24(gid_y, YUV_STRIDE, gid_x * 2));
 }
+
+__kernel void process_raw(const __global uchar * in, __global uchar * out, int expo_time ISP_LUT_ARGS)
+{
+  const int gid_x = get_global_id(0);
+  const int gid_y = get_global_id(1);
+
+  uchar8 dat[4], short_dat[4];
+  uchar extra_dat[4], short_extra_dat[4];
+  read_window(in, gid_x, gid_y, dat, extra_dat, short_dat, short_extra_dat);
+
+  uchar3 rgb_out[4]; // output is 2x2 window
+  debayer_2x2(dat, extra_dat, short_dat, short_extra_dat, expo_time, gid_x, gid_y, rgb_out ISP_LUT_PARAMS);
+  rgb2yuv_2x2(out, gid_x, gid_y, rgb_out);
+}
+
+#if defined(DOWNSCALE)
+// process_raw that also writes an nv12 image DOWNSCALE (2 or 4) times smaller than the
+// SCALED_WIDTH x SCALED_HEIGHT region at (SCALED_X, SCALED_Y) of the full image to
+// out_scaled, with its own SCALED_STRIDE and SCALED_UV_OFFSET. Scaled pixels are box
+// averages of the DOWNSCALE x DOWNSCALE pixels they cover, their chroma of the
+// 2*DOWNSCALE x 2*DOWNSCALE pixels. Every work item leaves the rgb sum of its 2x2 window
+// in local memory, and the work item at the top left of a chroma block adds up the
+// DOWNSCALE x DOWNSCALE sums of its block. Work groups are SCALED_GROUP_WIDTH x
+// SCALED_GROUP_HEIGHT, so chroma blocks never straddle two of them. The global size has
+// to be rounded up to whole work groups, work items outside the image only reach the barrier.
+#ifndef SCALED_X
+  #define SCALED_X 0
+  #define SCALED_Y 0
+  #define SCALED_WIDTH RGB_WIDTH
+  #define SCALED_HEIGHT RGB_HEIGHT
+#endif
+#ifndef SCALED_GROUP_WIDTH
+  #define SCALED_GROUP_WIDTH 16
+  #define SCALED_GROUP_HEIGHT DOWNSCALE
+#endif
+#if (DOWNSCALE != 2 && DOWNSCALE != 4) || SCALED_X % (2 * DOWNSCALE) || SCALED_Y % (2 * DOWNSCALE) || SCALED_WIDTH % (2 * DOWNSCALE) || SCALED_HEIGHT % (2 * DOWNSCALE)
+  #error "unsupported downscale region"
+#endif
+#if SCALED_GROUP_WIDTH % DOWNSCALE || SCALED_GROUP_HEIGHT % DOWNSCALE
+  #error "work groups have to hold whole chroma blocks"
+#endif
+
+__kernel __attribute__((reqd_work_group_size(SCALED_GROUP_WIDTH, SCALED_GROUP_HEIGHT, 1)))
+void process_raw_scaled(const __global uchar * in, __global uchar * out, __global uchar * out_scaled, int expo_time ISP_LUT_ARGS)
+{
+  const int gid_x = get_global_id(0);
+  const int gid_y = get_global_id(1);
+  const int lid_x = get_local_id(0);
+  const int lid_y = get_local_id(1);
+  const bool in_image = gid_x < RGB_WIDTH/2 && gid_y < RGB_HEIGHT/2;
+
+  // rgb sums of the 2x2 window of every work item of the group
+  __local int window_sums[3][SCALED_GROUP_HEIGHT][SCALED_GROUP_WIDTH];
+  if (in_image) {
+    uchar8 dat[4], short_dat[4];
+    uchar extra_dat[4], short_extra_dat[4];
+    read_window(in, gid_x, gid_y, dat, extra_dat, short_dat, short_extra_dat);
+
+    uchar3 rgb_out[4]; // output is 2x2 window
+    debayer_2x2(dat, extra_dat, short_dat, short_extra_dat, expo_time, gid_x, gid_y, rgb_out ISP_LUT_PARAMS);
+    rgb2yuv_2x2(out, gid_x, gid_y, rgb_out);
+
+    const int3 sum = convert_int3(rgb_out[0]) + convert_int3(rgb_out[1]) + convert_int3(rgb_out[2]) + convert_int3(rgb_out[3]);
+    window_sums[0][lid_y][lid_x] = sum.x;
+    window_sums[1][lid_y][lid_x] = sum.y;
+    window_sums[2][lid_y][lid_x] = sum.z;
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  // position in the region, in work items. A chroma block is DOWNSCALE x DOWNSCALE work
+  // items and 2x2 scaled pixels
+  const int sx = gid_x - SCALED_X/2;
+  const int sy = gid_y - SCALED_Y/2;
+  if (sx < 0 || sy < 0 || sx >= SCALED_WIDTH/2 || sy >= SCALED_HEIGHT/2 || sx % DOWNSCALE || sy % DOWNSCALE) {
+    return;
+  }
+
+  // rgb sums of the 2x2 scaled pixels of the block
+  int3 sums[4] = {(int3)(0), (int3)(0), (int3)(0), (int3)(0)};
+  for (int wy = 0; wy < DOWNSCALE; wy++) {
+    for (int wx = 0; wx < DOWNSCALE; wx++) {
+      sums[(wy / (DOWNSCALE/2)) * 2 + wx / (DOWNSCALE/2)] += (int3)(
+        window_sums[0][lid_y + wy][lid_x + wx],
+        window_sums[1][lid_y + wy][lid_x + wx],
+        window_sums[2][lid_y + wy][lid_x + wx]
+      );
+    }
+  }
+
+  const int n = DOWNSCALE * DOWNSCALE;
+  for (int i = 0; i < 4; i++) {
+    const int3 avg = (sums[i] + n/2) / n;
+    out_scaled[mad24(sy * 2 / DOWNSCALE + i / 2, SCALED_STRIDE, sx * 2 / DOWNSCALE + i % 2)] = RGB_TO_Y(avg.x, avg.y, avg.z);
+  }
+
+  // the chroma of rgb2yuv_2x2 takes twice the average, see AVERAGE
+  const int3 avg2 = (sums[0] + sums[1] + sums[2] + sums[3] + n) / (2 * n);
+  uchar2 uv = (uchar2)(
+    RGB_TO_U(avg2.x, avg2.y, avg2.z),
+    RGB_TO_V(avg2.x, avg2.y, avg2.z)
+  );
+  vstore2(uv, 0, out_scaled + SCALED_UV_OFFSET + mad24(sy / DOWNSCALE, SCALED_STRIDE, sx / DOWNSCALE * 2));
+}
+#endif
+
+#if defined(TILE_WIDTH)
+// process_raw for TILE_WIDTH x TILE_HEIGHT work groups. A work group first copies the
+// raw rows (and HDR rows) all of its work items read to local memory, once, and the
+// work items then read their rows from there. The global size has to be rounded up
+// to whole work groups, work items outside the image only help with the copy.
+#if BIT_DEPTH == 10 && TILE_WIDTH % 2
+  #error "10-bit tiles need an even TILE_WIDTH"
+#endif
+#if BIT_DEPTH == 10
+  #define TILE_ROW_BYTES (5 * TILE_WIDTH / 2 + 8)
+#else
+  #define TILE_ROW_BYTES (3 * TILE_WIDTH + 6)
+#endif
+#define TILE_ROWS (2 * TILE_HEIGHT + 2)
+#define FRAME_ROW_BYTES (RGB_WIDTH * BIT_DEPTH / 8)
+
+__kernel __attribute__((reqd_work_group_size(TILE_WIDTH, TILE_HEIGHT, 1)))
+void process_raw_tiled(const __global uchar * in, __global uchar * out, int expo_time ISP_LUT_ARGS)
+{
+  const int gid_x = get_global_id(0);
+  const int gid_y = get_global_id(1);
+  const int lid_x = get_local_id(0);
+  const int lid_y = get_local_id(1);
+
+  // the rows and bytes read_window reads for every work item of the group
+  __local uchar tile[TILE_ROWS * TILE_ROW_BYTES];
+  #if HDR_OFFSET > 0
+    __local uchar short_tile[TILE_ROWS * TILE_ROW_BYTES];
+  #endif
+  const int tile_x = window_col(gid_x - lid_x);
+  const int tile_y = 2 * (gid_y - lid_y) - 1;
+  for (int r = lid_y; r < TILE_ROWS; r += TILE_HEIGHT) {
+    // rows outside the image are mirrored, like row_before_offset and row_after_offset
+    int y = tile_y + r;
+    y = clamp(y < 0 ? -y : (y >= RGB_HEIGHT ? 2 * (RGB_HEIGHT - 1) - y : y), 0, RGB_HEIGHT - 1);
+    for (int c = lid_x; c < TILE_ROW_BYTES; c += TILE_WIDTH) {
+      // bytes outside the row only end up in mirror padded pixels
+      const int x = tile_x + c;
+      const bool in_row = x >= 0 && x < FRAME_ROW_BYTES;
+      tile[mad24(r, TILE_ROW_BYTES, c)] = in_row ? in[mad24(y + FRAME_OFFSET, FRAME_STRIDE, x)] : 0;
+      #if HDR_OFFSET > 0
+        short_tile[mad24(r, TILE_ROW_BYTES, c)] = in_row ? in[mad24(y + FRAME_OFFSET + HDR_OFFSET/2, FRAME_STRIDE, x + FRAME_STRIDE/2)] : 0;
+      #endif
+    }
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  if (gid_x >= RGB_WIDTH/2 || gid_y >= RGB_HEIGHT/2) {
+    return;
+  }
+
+  uchar8 dat[4], short_dat[4];
+  uchar extra_dat[4], short_extra_dat[4];
+  const int start_idx = mad24(2 * lid_y, TILE_ROW_BYTES, window_col(gid_x) - tile_x);
+  for (int i = 0; i < 4; i++) {
+    dat[i] = vload8(0, tile + start_idx + TILE_ROW_BYTES*i);
+    extra_dat[i] = tile[start_idx + TILE_ROW_BYTES*i + 8];
+    #if HDR_OFFSET > 0
+      short_dat[i] = vload8(0, short_tile + start_idx + TILE_ROW_BYTES*i);
+      short_extra_dat[i] = short_tile[start_idx + TILE_ROW_BYTES*i + 8];
+    #endif
+  }
+
+  uchar3 rgb_out[4]; // output is 2x2 window
+  debayer_2x2(dat, extra_dat, short_dat, short_extra_dat, expo_time, gid_x, gid_y, rgb_out ISP_LUT_PARAMS);
+  rgb2yuv_2x2(out, gid_x, gid_y, rgb_out);
+}
+#endif
+
+#if defined(AE_STATS)
+// process_raw that also adds the Y histogram of the AE region to the AE_STATS_BINS
+// counts of ae_stats, so AE reads those instead of going over the image. Every AE_X_SKIP-th pixel
+// of every AE_Y_SKIP-th row of the AE_WIDTH x AE_HEIGHT region at (AE_X, AE_Y) is counted,
+// as in the CPU measurement. Work groups count in local memory and add their bins to
+// ae_stats once, which has to be cleared before every frame.
+#define AE_STATS_BINS 256
+#ifndef AE_X
+  #define AE_X 0
+  #define AE_Y 0
+  #define AE_WIDTH RGB_WIDTH
+  #define AE_HEIGHT RGB_HEIGHT
+#endif
+#ifndef AE_X_SKIP
+  #define AE_X_SKIP 1
+  #define AE_Y_SKIP 1
+#endif
+
+__kernel void process_raw_stats(const __global uchar * in, __global uchar * out, volatile __global uint * ae_stats, int expo_time ISP_LUT_ARGS)
+{
+  const int gid_x = get_global_id(0);
+  const int gid_y = get_global_id(1);
+  const int lid = mad24((int)get_local_id(1), (int)get_local_size(0), (int)get_local_id(0));
+  const int group_size = get_local_size(0) * get_local_size(1);
+
+  __local uint hist[AE_STATS_BINS];
+  for (int i = lid; i < AE_STATS_BINS; i += group_size) {
+    hist[i] = 0;
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  uchar8 dat[4], short_dat[4];
+  uchar extra_dat[4], short_extra_dat[4];
+  read_window(in, gid_x, gid_y, dat, extra_dat, short_dat, short_extra_dat);
+
+  uchar3 rgb_out[4]; // output is 2x2 window
+  debayer_2x2(dat, extra_dat, short_dat, short_extra_dat, expo_time, gid_x, gid_y, rgb_out ISP_LUT_PARAMS);
+  rgb2yuv_2x2(out, gid_x, gid_y, rgb_out);
+
+  for (int i = 0; i < 4; i++) {
+    const int x = gid_x * 2 + (i & 1) - AE_X;
+    const int y = gid_y * 2 + (i >> 1) - AE_Y;
+    if (x >= 0 && x < AE_WIDTH && y >= 0 && y < AE_HEIGHT && x % AE_X_SKIP == 0 && y % AE_Y_SKIP == 0) {
+      atomic_inc(&hist[RGB_TO_Y(rgb_out[i].s0, rgb_out[i].s1, rgb_out[i].s2)]);
+    }
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  for (int i = lid; i < AE_STATS_BINS; i += group_size) {
+    if (hist[i] > 0) {
+      atomic_add(&ae_stats[i], hist[i]);
+    }
+  }
+}
+#endif
+
+#if defined(ISP_LUTS)
+// vignetting correction factor of every work item, RGB_WIDTH/2 x RGB_HEIGHT/2
+__kernel void bake_vignetting(__global float * vignetting)
+{
+  const int gid_x = get_global_id(0);
+  const int gid_y = get_global_id(1);
+
+  #if VIGNETTING
+    int gx = (gid_x*2 - RGB_WIDTH/2);
+    int gy = (gid_y*2 - RGB_HEIGHT/2);
+    vignetting[mad24(gid_y, RGB_WIDTH/2, gid_x)] = get_vignetting_s((gx*gx + gy*gy) / VIGNETTE_RSZ);
+  #else
+    vignetting[mad24(gid_y, RGB_WIDTH/2, gid_x)] = 1.0;
+  #endif
+}
+
+// gamma and HDR combine tables for expo_time, ISP_LUT_SIZE entries
+__kernel void bake_isp_lut(__global float * isp_lut, int expo_time)
+{
+  const int i = get_global_id(0);
+
+  if (i < GAMMA_LUT_SIZE) {
+    isp_lut[i] = apply_gamma((float3)(gamma_lut_x(i)), expo_time).x;
+  }
+  #if BIT_DEPTH == 10
+    else if (i < HDR_LUT_OFFSET + (1 << BIT_DEPTH)) {
+      // negative values become 0 in normalize_pv_hdr anyway, so -1 can mark the short exposure
+      const float lv = (float)(i - HDR_LUT_OFFSET - BLACK_LVL);
+      isp_lut[i] = use_long_pv(lv, expo_time) ? fmax(long_pv(lv, expo_time), 0.0f) : -1.0f;
+    } else if (i < ISP_LUT_SIZE) {
+      const float sv = (float)(i - HDR_LUT_OFFSET - (1 << BIT_DEPTH) - BLACK_LVL);
+      isp_lut[i] = short_pv(sv, expo_time);
+    }
+  #endif
+}
+#endif
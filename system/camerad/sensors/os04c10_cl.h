@@ -8,25 +8,38 @@
 #define BLACK_LVL 64
 #define VIGNETTE_RSZ 2.2545f
 
-float combine_dual_pvs(float lv, float sv, int expo_time) {
-  float svc = fmax(sv * expo_time, (float)(64 * (PV_MAX10 - BLACK_LVL)));
-  float svd = sv * fmin(expo_time, 8.0) / 8;
+// the long exposure value is used unless it is clipped, or too dark at short exposure
+// times. Split up so process_raw can tabulate both sides per exposure time.
+bool use_long_pv(float lv, int expo_time) {
+  if (expo_time > 64) {
+    return lv < PV_MAX10 - BLACK_LVL;
+  } else {
+    return lv > 32;
+  }
+}
 
+float long_pv(float lv, int expo_time) {
   if (expo_time > 64) {
-    if (lv < PV_MAX10 - BLACK_LVL) {
-      return lv / (PV_MAX16 - BLACK_LVL);
-    } else {
-      return (svc / 64) / (PV_MAX16 - BLACK_LVL);
-    }
+    return lv / (PV_MAX16 - BLACK_LVL);
   } else {
-    if (lv > 32) {
-      return (lv * 64 / fmax(expo_time, 8.0)) / (PV_MAX16 - BLACK_LVL);
-    } else {
-      return svd / (PV_MAX16 - BLACK_LVL);
-    }
+    return (lv * 64 / fmax(expo_time, 8.0)) / (PV_MAX16 - BLACK_LVL);
   }
 }
 
+float short_pv(float sv, int expo_time) {
+  if (expo_time > 64) {
+    float svc = fmax(sv * expo_time, (float)(64 * (PV_MAX10 - BLACK_LVL)));
+    return (svc / 64) / (PV_MAX16 - BLACK_LVL);
+  } else {
+    float svd = sv * fmin(expo_time, 8.0) / 8;
+    return svd / (PV_MAX16 - BLACK_LVL);
+  }
+}
+
+float combine_dual_pvs(float lv, float sv, int expo_time) {
+  return use_long_pv(lv, expo_time) ? long_pv(lv, expo_time) : short_pv(sv, expo_time);
+}
+
 float4 normalize_pv_hdr(int4 parsed, int4 short_parsed, float vignette_factor, int expo_time) {
   float4 pl = convert_float4(parsed - BLACK_LVL);
   float4 ps = convert_float4(short_parsed - BLACK_LVL);
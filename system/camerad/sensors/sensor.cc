@@ -0,0 +1,55 @@
+#include "system/camerad/sensors/sensor.h"
+
+#include <algorithm>
+#include <cmath>
+
+void SensorInfo::initExposureTable() const {
+  for (int g = 0; g < ANALOG_GAIN_MAX_CNT; g++) {
+    inv_analog_gains[g] = 1.0f / sensor_analog_gains[g];
+  }
+  // two probes per entry: no ev error gives base, an ev error of one adds slope
+  for (int gain_idx = 0; gain_idx < ANALOG_GAIN_MAX_CNT; gain_idx++) {
+    for (int g = 0; g < ANALOG_GAIN_MAX_CNT; g++) {
+      float base = getExposureScore(0, 0, g, sensor_analog_gains[g], gain_idx);
+      float slope = getExposureScore(1, 0, g, sensor_analog_gains[g], gain_idx) - base;
+      exposure_cost_table[gain_idx * ANALOG_GAIN_MAX_CNT + g] = {base, slope};
+    }
+  }
+}
+
+bool SensorInfo::findBestExposure(float desired_ev, float gain_factor, int gain_idx, int min_gain_idx, int max_gain_idx,
+                                  int &exp_t, int &exp_g_idx) const {
+  std::call_once(exposure_table_once, &SensorInfo::initExposureTable, this);
+  min_gain_idx = std::max(min_gain_idx, analog_gain_min_idx);
+  max_gain_idx = std::min(max_gain_idx, analog_gain_max_idx);
+  if (min_gain_idx > max_gain_idx) {
+    return false;
+  }
+  const ExposureCost *cost = &exposure_cost_table[gain_idx * ANALOG_GAIN_MAX_CNT];
+
+  // score every candidate without branches or libm calls so the loop vectorizes, then
+  // take the argmin
+  const float ev_per_gain = desired_ev / gain_factor;
+  const float t_min = exposure_time_min, t_max = exposure_time_max;
+  float score[ANALOG_GAIN_MAX_CNT];
+  int exp_time[ANALOG_GAIN_MAX_CNT];
+  for (int g = min_gain_idx; g <= max_gain_idx; g++) {
+    // optimal time for this gain, rounded half up after clamping to the non-negative
+    // integer limits, which gives the same time as clamping the rounded one
+    int t = (int)(std::min(std::max(ev_per_gain * inv_analog_gains[g], t_min), t_max) + 0.5f);
+    // Only go below recommended gain when absolutely necessary to not overexpose
+    bool skip = (g < analog_gain_rec_idx) & (t > 20) & (g < gain_idx);
+    float s = cost[g].base + cost[g].slope * std::abs(desired_ev - t * (sensor_analog_gains[g] * gain_factor));
+    exp_time[g] = t;
+    // a penalty rather than a select on the score, so the score isn't sunk into a branch
+    score[g] = s + (skip ? INFINITY : 0.0f);
+  }
+
+  int best = std::min_element(score + min_gain_idx, score + max_gain_idx + 1) - score;
+  if (std::isinf(score[best])) {
+    return false;
+  }
+  exp_t = exp_time[best];
+  exp_g_idx = best;
+  return true;
+}
@@ -1,8 +1,10 @@
 #pragma once
 
+#include <array>
 #include <cassert>
 #include <cstdint>
 #include <map>
+#include <mutex>
 #include <utility>
 #include <vector>
 #include "media/cam_sensor.h"
@@ -13,6 +15,49 @@
 
 #define ANALOG_GAIN_MAX_CNT 55
 
+// Register address -> (first byte, second byte) offset in the embedded register rows.
+// Registers are 16 bit so only even addresses are stored, in a flat array over the
+// address range seen so far.
+class RegisterLut {
+public:
+  bool empty() const { return offsets.empty(); }
+
+  // from the map built by ar0231_build_register_lut
+  RegisterLut &operator=(const std::map<uint16_t, std::pair<int, int>> &registers) {
+    offsets.clear();
+    for (const auto &r : registers) {
+      assert(r.first % 2 == 0);
+    }
+    if (!registers.empty()) {
+      base_idx = registers.begin()->first / 2;
+      offsets.resize(registers.rbegin()->first / 2 - base_idx + 1, {0, 0});
+      for (const auto &[addr, offset] : registers) {
+        offsets[addr / 2 - base_idx] = offset;
+      }
+    }
+    return *this;
+  }
+
+  std::pair<int, int> &operator[](uint16_t addr) {
+    assert(addr % 2 == 0);
+    int idx = addr / 2;
+    if (offsets.empty()) {
+      base_idx = idx;
+    } else if (idx < base_idx) {
+      offsets.insert(offsets.begin(), base_idx - idx, {0, 0});
+      base_idx = idx;
+    }
+    if (idx - base_idx >= (int)offsets.size()) {
+      offsets.resize(idx - base_idx + 1, {0, 0});
+    }
+    return offsets[idx - base_idx];
+  }
+
+private:
+  int base_idx = 0;
+  std::vector<std::pair<int, int>> offsets;
+};
+
 class SensorInfo {
 public:
   SensorInfo() = default;
@@ -21,6 +66,12 @@ public:
   virtual int getSlaveAddress(int port) const { assert(0); }
   virtual void processRegisters(CameraState *c, cereal::FrameData::Builder &framed) const {}
 
+  // Exposure time and gain index in [min_gain_idx, max_gain_idx] with the lowest score
+  // for desired_ev, starting from gain_idx. Returns false if every gain was skipped.
+  // The score table is built on the first call, once the sensor's gains are set.
+  bool findBestExposure(float desired_ev, float gain_factor, int gain_idx, int min_gain_idx, int max_gain_idx,
+                        int &exp_t, int &exp_g_idx) const;
+
   cereal::FrameData::ImageSensor image_sensor = cereal::FrameData::ImageSensor::UNKNOWN;
   float pixel_size_mm;
   uint32_t frame_width, frame_height;
@@ -60,6 +111,21 @@ public:
   uint32_t mipi_format;
   uint32_t mclk_frequency;
   uint32_t frame_data_type;
+
+private:
+  // The score of every sensor is affine in the ev error |desired_ev - exp_t * exp_gain|:
+  // score = base + slope * ev_error, with base and slope only depending on the gain indices
+  struct ExposureCost {
+    float base;
+    float slope;
+  };
+  // Tabulates getExposureScore for every (gain index, current gain index) pair. Virtual
+  // calls aren't dispatched to the sensor from the SensorInfo constructor, hence lazily.
+  void initExposureTable() const;
+
+  mutable std::once_flag exposure_table_once;
+  mutable std::array<ExposureCost, ANALOG_GAIN_MAX_CNT * ANALOG_GAIN_MAX_CNT> exposure_cost_table;  // [gain_idx][exp_g_idx]
+  mutable std::array<float, ANALOG_GAIN_MAX_CNT> inv_analog_gains;
 };
 
 class AR0231 : public SensorInfo {
@@ -71,7 +137,7 @@ public:
   void processRegisters(CameraState *c, cereal::FrameData::Builder &framed) const override;
 
 private:
-  mutable std::map<uint16_t, std::pair<int, int>> ar0231_register_lut;
+  mutable RegisterLut ar0231_register_lut;
 };
 
 class OX03C10 : public SensorInfo {
@@ -0,0 +1,181 @@
+// Times process_raw against process_raw_tiled for every sensor on the default OpenCL
+// device, e.g. pocl on a PC, and checks both give the same image. The frames are
+// random raw data with the frame size, stride and HDR layout of each sensor.
+// The times only hold for the device it runs on: local memory on a CPU runtime like
+// pocl is plain cached memory, so they say nothing about the tiled kernel on the GPU.
+//
+//   cd system/camerad && ./test/benchmark_process_raw [-n frames] [-x tile_width] [-y tile_height] [-v] [-l]
+//
+// -v enables vignetting correction, as on the driver camera, -l builds the kernels with
+// ISP_LUTS to read vignetting, gamma and HDR combine from baked tables.
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "common/clutil.h"
+#include "system/camerad/sensors/sensor.h"
+
+struct BenchmarkConfig {
+  int frames = 100;
+  int tile_width = 16;
+  int tile_height = 8;
+  bool vignetting = false;
+  bool isp_luts = false;
+};
+
+// at least ISP_LUT_SIZE of process_raw.cl for every sensor
+const int ISP_LUT_SIZE_MAX = 4096;
+
+static const char *sensor_name(const SensorInfo &sensor) {
+  switch (sensor.image_sensor) {
+    case cereal::FrameData::ImageSensor::AR0231: return "ar0231";
+    case cereal::FrameData::ImageSensor::OX03C10: return "ox03c10";
+    case cereal::FrameData::ImageSensor::OS04C10: return "os04c10";
+    default: return "unknown";
+  }
+}
+
+// mean time per frame in ms, out holds the image of the last frame
+static double run_kernel(cl_command_queue q, cl_kernel kernel, const size_t *global_size, const size_t *local_size,
+                         int frames, cl_mem out_cl, std::vector<uint8_t> &out) {
+  // cleared so pixels the kernel doesn't write can't pass as the output of an earlier run
+  const uint8_t zero = 0;
+  CL_CHECK(clEnqueueFillBuffer(q, out_cl, &zero, sizeof(zero), 0, out.size(), 0, NULL, NULL));
+
+  // the first run includes the lazy parts of program setup
+  CL_CHECK(clEnqueueNDRangeKernel(q, kernel, 2, NULL, global_size, local_size, 0, NULL, NULL));
+  CL_CHECK(clFinish(q));
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < frames; i++) {
+    CL_CHECK(clEnqueueNDRangeKernel(q, kernel, 2, NULL, global_size, local_size, 0, NULL, NULL));
+    CL_CHECK(clFinish(q));
+  }
+  double dt = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+  CL_CHECK(clEnqueueReadBuffer(q, out_cl, CL_TRUE, 0, out.size(), out.data(), 0, NULL, NULL));
+  return dt / frames;
+}
+
+static void benchmark_sensor(cl_device_id device_id, cl_context context, const SensorInfo &sensor, const BenchmarkConfig &cfg) {
+  const int rgb_width = sensor.frame_width, rgb_height = sensor.frame_height;
+  const int yuv_stride = (rgb_width + 63) & ~63;
+  const int uv_offset = yuv_stride * rgb_height;
+
+  char args[4096];
+  snprintf(args, sizeof(args),
+           "-cl-fast-relaxed-math -cl-denorms-are-zero -Isensors "
+           "-DFRAME_WIDTH=%d -DFRAME_HEIGHT=%d -DFRAME_STRIDE=%d -DFRAME_OFFSET=%d "
+           "-DRGB_WIDTH=%d -DRGB_HEIGHT=%d -DYUV_STRIDE=%d -DUV_OFFSET=%d "
+           "-DSENSOR_ID=%hu -DHDR_OFFSET=%d -DVIGNETTING=%d -DTILE_WIDTH=%d -DTILE_HEIGHT=%d%s",
+           sensor.frame_width, sensor.frame_height, sensor.frame_stride, sensor.frame_offset,
+           rgb_width, rgb_height, yuv_stride, uv_offset,
+           (uint16_t)sensor.image_sensor, sensor.hdr_offset, cfg.vignetting, cfg.tile_width, cfg.tile_height,
+           cfg.isp_luts ? " -DISP_LUTS" : "");
+  const int expo_time = 100;
+  cl_program prg = cl_program_from_file(context, device_id, "cameras/process_raw.cl", args);
+  cl_kernel krnl = CL_CHECK_ERR(clCreateKernel(prg, "process_raw", &err));
+  cl_kernel krnl_tiled = CL_CHECK_ERR(clCreateKernel(prg, "process_raw_tiled", &err));
+  cl_command_queue q = CL_CHECK_ERR(clCreateCommandQueue(context, device_id, 0, &err));
+  const size_t global_size[] = {(size_t)rgb_width / 2, (size_t)rgb_height / 2};
+
+  // baked once, outside of the timed runs
+  cl_mem vignetting_cl = NULL, isp_lut_cl = NULL;
+  if (cfg.isp_luts) {
+    vignetting_cl = CL_CHECK_ERR(clCreateBuffer(context, CL_MEM_READ_WRITE, global_size[0] * global_size[1] * sizeof(float), NULL, &err));
+    isp_lut_cl = CL_CHECK_ERR(clCreateBuffer(context, CL_MEM_READ_WRITE, ISP_LUT_SIZE_MAX * sizeof(float), NULL, &err));
+    cl_kernel krnl_vignetting = CL_CHECK_ERR(clCreateKernel(prg, "bake_vignetting", &err));
+    cl_kernel krnl_isp_lut = CL_CHECK_ERR(clCreateKernel(prg, "bake_isp_lut", &err));
+    CL_CHECK(clSetKernelArg(krnl_vignetting, 0, sizeof(cl_mem), &vignetting_cl));
+    CL_CHECK(clSetKernelArg(krnl_isp_lut, 0, sizeof(cl_mem), &isp_lut_cl));
+    CL_CHECK(clSetKernelArg(krnl_isp_lut, 1, sizeof(int), &expo_time));
+    const size_t lut_size = ISP_LUT_SIZE_MAX;
+    CL_CHECK(clEnqueueNDRangeKernel(q, krnl_vignetting, 2, NULL, global_size, NULL, 0, NULL, NULL));
+    CL_CHECK(clEnqueueNDRangeKernel(q, krnl_isp_lut, 1, NULL, &lut_size, NULL, 0, NULL, NULL));
+    CL_CHECK(clFinish(q));
+    CL_CHECK(clReleaseKernel(krnl_isp_lut));
+    CL_CHECK(clReleaseKernel(krnl_vignetting));
+  }
+  CL_CHECK(clReleaseProgram(prg));
+
+  // the last work items read a little past the frame
+  std::vector<uint8_t> raw((size_t)sensor.frame_stride * (sensor.frame_height + sensor.extra_height + 2));
+  std::mt19937 rng(0);
+  std::generate(raw.begin(), raw.end(), [&]() { return rng() & 0xff; });
+  cl_mem in_cl = CL_CHECK_ERR(clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, raw.size(), raw.data(), &err));
+  std::vector<uint8_t> out(yuv_stride * rgb_height * 3 / 2), out_tiled(out.size());
+  cl_mem out_cl = CL_CHECK_ERR(clCreateBuffer(context, CL_MEM_WRITE_ONLY, out.size(), NULL, &err));
+
+  for (cl_kernel k : {krnl, krnl_tiled}) {
+    CL_CHECK(clSetKernelArg(k, 0, sizeof(cl_mem), &in_cl));
+    CL_CHECK(clSetKernelArg(k, 1, sizeof(cl_mem), &out_cl));
+    CL_CHECK(clSetKernelArg(k, 2, sizeof(int), &expo_time));
+    if (cfg.isp_luts) {
+      CL_CHECK(clSetKernelArg(k, 3, sizeof(cl_mem), &vignetting_cl));
+      CL_CHECK(clSetKernelArg(k, 4, sizeof(cl_mem), &isp_lut_cl));
+    }
+  }
+
+  const size_t local_size_tiled[] = {(size_t)cfg.tile_width, (size_t)cfg.tile_height};
+  const size_t global_size_tiled[] = {(global_size[0] + cfg.tile_width - 1) / cfg.tile_width * cfg.tile_width,
+                                      (global_size[1] + cfg.tile_height - 1) / cfg.tile_height * cfg.tile_height};
+  double ms = run_kernel(q, krnl, global_size, NULL, cfg.frames, out_cl, out);
+  double ms_tiled = run_kernel(q, krnl_tiled, global_size_tiled, local_size_tiled, cfg.frames, out_cl, out_tiled);
+
+  printf("%-10s%5dx%-6d%10.2f%10.2f%9.2fx%10s\n", sensor_name(sensor), rgb_width, rgb_height, ms, ms_tiled, ms / ms_tiled,
+         out == out_tiled ? "yes" : "NO");
+
+  CL_CHECK(clReleaseCommandQueue(q));
+  CL_CHECK(clReleaseMemObject(out_cl));
+  CL_CHECK(clReleaseMemObject(in_cl));
+  if (cfg.isp_luts) {
+    CL_CHECK(clReleaseMemObject(isp_lut_cl));
+    CL_CHECK(clReleaseMemObject(vignetting_cl));
+  }
+  CL_CHECK(clReleaseKernel(krnl_tiled));
+  CL_CHECK(clReleaseKernel(krnl));
+}
+
+int main(int argc, char *argv[]) {
+  BenchmarkConfig cfg;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:x:y:vlh")) != -1) {
+    switch (opt) {
+      case 'n': cfg.frames = std::max(1, atoi(optarg)); break;
+      case 'x': cfg.tile_width = std::max(1, atoi(optarg)); break;
+      case 'y': cfg.tile_height = std::max(1, atoi(optarg)); break;
+      case 'v': cfg.vignetting = true; break;
+      case 'l': cfg.isp_luts = true; break;
+      default:
+        fprintf(stderr, "usage: %s [-n frames] [-x tile_width] [-y tile_height] [-v] [-l]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (cfg.tile_width % 2) {
+    // process_raw.cl can't build odd tile widths for 10-bit sensors
+    fprintf(stderr, "tile width has to be even, the 10-bit os04c10 packs 4 pixels into 5 bytes\n");
+    return 1;
+  }
+
+  cl_device_id device_id = cl_get_device_id(CL_DEVICE_TYPE_DEFAULT);
+  cl_context context = cl_create_context(device_id);
+  char device_name[256] = {};
+  CL_CHECK(clGetDeviceInfo(device_id, CL_DEVICE_NAME, sizeof(device_name) - 1, device_name, NULL));
+  printf("%s, %d frames, %dx%d tiles%s\n", device_name, cfg.frames, cfg.tile_width, cfg.tile_height, cfg.isp_luts ? ", isp luts" : "");
+  printf("%-10s%12s%10s%10s%10s%10s\n", "sensor", "size", "ms", "tiled ms", "ms ratio", "same");
+
+  std::unique_ptr<SensorInfo> sensors[] = {std::make_unique<AR0231>(), std::make_unique<OX03C10>(), std::make_unique<OS04C10>()};
+  for (auto &sensor : sensors) {
+    benchmark_sensor(device_id, context, *sensor, cfg);
+  }
+
+  CL_CHECK(clReleaseContext(context));
+  return 0;
+}
@@ -0,0 +1,364 @@
+// Replays raw frame dumps through the camerad ISP on the default OpenCL device, e.g. pocl
+// on a PC: process_raw, the AE grey measurement and exposure search, then publishes the
+// yuv frames over VisionIpc as the road camera and reports the time of every stage.
+//
+//   cd system/camerad && ./test/replay_raw -s sensor [-n frames] [-r fps] [-v] [-l] [-g] dump.raw
+//
+// A dump holds whole camera buffers back to back, frame_stride * (frame_height + extra_height)
+// bytes each, as the sensor sends them (embedded rows, HDR exposures). It is replayed in a
+// loop until -n frames were processed. The exposure AE picks is fed back into process_raw
+// like on the device, even though it has no effect on the replayed frames.
+//
+// -v enables vignetting correction, -l builds the kernels with ISP_LUTS and rebakes the
+// tables whenever the exposure time changes. -g measures the grey from the histogram
+// process_raw_stats builds on the device instead of going over the image on the CPU.
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common/clcache.h"
+#include "common/clutil.h"
+#include "msgq/visionipc/visionipc_server.h"
+#include "system/camerad/sensors/sensor.h"
+
+struct ReplayConfig {
+  std::string sensor;
+  std::string path;
+  int frames = 0;  // 0: every frame of the dump once
+  float fps = 0;   // 0: as fast as possible
+  bool vignetting = false;
+  bool isp_luts = false;
+  bool gpu_stats = false;
+};
+
+// at least ISP_LUT_SIZE of process_raw.cl for every sensor
+const int ISP_LUT_SIZE_MAX = 4096;
+const int YUV_BUFFER_COUNT = 20;
+// AE_STATS_BINS of process_raw.cl
+const int AE_STATS_BINS = 256;
+// every AE_X_SKIP-th pixel of every AE_Y_SKIP-th row of the AE region is measured
+const int AE_X_SKIP = 2;
+const int AE_Y_SKIP = 4;
+
+enum Stage { UPLOAD, LUTS, PROCESS_RAW, STATS, AE, SEND, TOTAL, STAGE_COUNT };
+static const char *stage_names[STAGE_COUNT] = {"upload", "luts", "process_raw", "stats", "ae", "send", "total"};
+
+struct StageTimes {
+  double sum[STAGE_COUNT] = {};
+  double max[STAGE_COUNT] = {};
+  int count[STAGE_COUNT] = {};
+
+  void add(Stage s, double ms) {
+    sum[s] += ms;
+    max[s] = std::max(max[s], ms);
+    count[s]++;
+  }
+};
+
+class StageTimer {
+public:
+  StageTimer(StageTimes &times, Stage stage) : times_(times), stage_(stage), start_(std::chrono::steady_clock::now()) {}
+  ~StageTimer() { times_.add(stage_, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_).count()); }
+
+private:
+  StageTimes &times_;
+  Stage stage_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+static std::unique_ptr<SensorInfo> make_sensor(const std::string &name) {
+  if (name == "ar0231") return std::make_unique<AR0231>();
+  if (name == "ox03c10") return std::make_unique<OX03C10>();
+  if (name == "os04c10") return std::make_unique<OS04C10>();
+  return nullptr;
+}
+
+// Same closed loop as the road camera in camerad: the median grey of the AE region drives
+// the target EV, low light switches to DC gain, and the exposure search picks time and gain.
+struct AutoExposure {
+  explicit AutoExposure(const SensorInfo *s) : sensor(s) {
+    gain_idx = sensor->analog_gain_rec_idx;
+    exposure_time = 5;
+    float gain = sensor->sensor_analog_gains[gain_idx] * dc_gain_factor();
+    std::fill(std::begin(cur_ev), std::end(cur_ev), exposure_time * gain);
+  }
+
+  float dc_gain_factor() const {
+    return 1.0 + dc_gain_weight * (sensor->dc_gain_factor - 1.0) / sensor->dc_gain_max_weight;
+  }
+
+  void update(float grey_frac, uint32_t frame_id) {
+    const float dt = 0.05;
+    const float ts_grey = 10.0;
+    const float ts_ev = 0.05;
+    const float k_grey = (dt / ts_grey) / (1.0 + dt / ts_grey);
+    const float k_ev = (dt / ts_ev) / (1.0 + dt / ts_ev);
+
+    // the measured grey is the result of the exposure set three frames ago
+    const float cur_ev_ = cur_ev[frame_id % 3];
+    float new_target_grey = std::clamp(0.4 - 0.3 * log2(1.0 + sensor->target_grey_factor * cur_ev_) / log2(6000.0), 0.1, 0.4);
+    float target_grey = (1.0 - k_grey) * target_grey_fraction + k_grey * new_target_grey;
+
+    float desired_ev = std::clamp(cur_ev_ * target_grey / std::max(grey_frac, 1e-3f), sensor->min_ev, sensor->max_ev);
+    float k = (1.0 - k_ev) / 3.0;
+    desired_ev = (k * cur_ev[0]) + (k * cur_ev[1]) + (k * cur_ev[2]) + (k_ev * desired_ev);
+
+    // hysteresis around high conversion gain
+    if (!dc_gain_enabled && target_grey < sensor->dc_gain_on_grey) {
+      dc_gain_enabled = true;
+      dc_gain_weight = sensor->dc_gain_min_weight;
+    } else if (dc_gain_enabled && target_grey > sensor->dc_gain_off_grey) {
+      dc_gain_enabled = false;
+      dc_gain_weight = sensor->dc_gain_max_weight;
+    }
+    if (dc_gain_enabled && dc_gain_weight < sensor->dc_gain_max_weight) dc_gain_weight += 1;
+    if (!dc_gain_enabled && dc_gain_weight > sensor->dc_gain_min_weight) dc_gain_weight -= 1;
+
+    // like camerad, the gain moves at most one step per frame
+    int new_exp_t, new_exp_g;
+    if (sensor->findBestExposure(desired_ev, dc_gain_factor(), gain_idx,
+                                 std::max(sensor->analog_gain_min_idx, gain_idx - 1), std::min(sensor->analog_gain_max_idx, gain_idx + 1),
+                                 new_exp_t, new_exp_g)) {
+      exposure_time = new_exp_t;
+      gain_idx = new_exp_g;
+    }
+    target_grey_fraction = target_grey;
+    cur_ev[frame_id % 3] = exposure_time * sensor->sensor_analog_gains[gain_idx] * dc_gain_factor();
+  }
+
+  const SensorInfo *sensor;
+  int exposure_time;
+  int gain_idx;
+  bool dc_gain_enabled = false;
+  int dc_gain_weight = 0;
+  float target_grey_fraction = 0.3;
+  float cur_ev[3];
+};
+
+// median luminance of a Y histogram as a fraction
+static float grey_fraction(const uint32_t *lum_binning) {
+  uint32_t lum_total = 0;
+  for (int i = 0; i < AE_STATS_BINS; i++) {
+    lum_total += lum_binning[i];
+  }
+
+  uint32_t lum_cur = 0;
+  int lum_med = AE_STATS_BINS - 1;
+  for (; lum_med > 0; lum_med--) {
+    lum_cur += lum_binning[lum_med];
+    if (lum_cur >= lum_total / 2) break;
+  }
+  return lum_med / 256.0;
+}
+
+// Y histogram of the w x h region at (x0, y0), the CPU version of process_raw_stats
+static void grey_histogram(const uint8_t *y_plane, int stride, int x0, int y0, int w, int h, uint32_t *lum_binning) {
+  std::fill(lum_binning, lum_binning + AE_STATS_BINS, 0);
+  for (int y = y0; y < y0 + h; y += AE_Y_SKIP) {
+    const uint8_t *row = y_plane + (size_t)y * stride;
+    for (int x = x0; x < x0 + w; x += AE_X_SKIP) {
+      lum_binning[row[x]]++;
+    }
+  }
+}
+
+static int replay(cl_device_id device_id, cl_context context, const SensorInfo &sensor, const ReplayConfig &cfg) {
+  const size_t frame_size = (size_t)sensor.frame_stride * (sensor.frame_height + sensor.extra_height);
+  std::ifstream f(cfg.path, std::ios::binary);
+  std::vector<uint8_t> dump((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+  const int dump_frames = dump.size() / frame_size;
+  if (dump_frames == 0) {
+    fprintf(stderr, "%s: %zu bytes, less than one %zu byte frame\n", cfg.path.c_str(), dump.size(), frame_size);
+    return 1;
+  }
+  if (dump.size() % frame_size != 0) {
+    fprintf(stderr, "%s: ignoring %zu trailing bytes\n", cfg.path.c_str(), dump.size() % frame_size);
+  }
+  const int frames = cfg.frames > 0 ? cfg.frames : dump_frames;
+
+  const int rgb_width = sensor.frame_width, rgb_height = sensor.frame_height;
+  const int yuv_stride = (rgb_width + 63) & ~63;
+  const int uv_offset = yuv_stride * rgb_height;
+  const size_t yuv_size = (size_t)uv_offset * 3 / 2;
+
+  VisionIpcServer vipc_server("camerad", device_id, context);
+  vipc_server.create_buffers_with_sizes(VISION_STREAM_ROAD, YUV_BUFFER_COUNT, false, rgb_width, rgb_height, yuv_size, yuv_stride, uv_offset);
+  vipc_server.start_listener();
+
+  // AE region of the road camera
+  const int ae_x = rgb_width / 20, ae_w = rgb_width - 2 * ae_x;
+  const int ae_y = rgb_height / 4, ae_h = rgb_height / 2;
+
+  char args[4096];
+  snprintf(args, sizeof(args),
+           "-cl-fast-relaxed-math -cl-denorms-are-zero -Isensors "
+           "-DFRAME_WIDTH=%d -DFRAME_HEIGHT=%d -DFRAME_STRIDE=%d -DFRAME_OFFSET=%d "
+           "-DRGB_WIDTH=%d -DRGB_HEIGHT=%d -DYUV_STRIDE=%d -DUV_OFFSET=%d "
+           "-DSENSOR_ID=%hu -DHDR_OFFSET=%d -DVIGNETTING=%d%s "
+           "-DAE_X=%d -DAE_Y=%d -DAE_WIDTH=%d -DAE_HEIGHT=%d -DAE_X_SKIP=%d -DAE_Y_SKIP=%d%s",
+           sensor.frame_width, sensor.frame_height, sensor.frame_stride, sensor.frame_offset,
+           rgb_width, rgb_height, yuv_stride, uv_offset,
+           (uint16_t)sensor.image_sensor, sensor.hdr_offset, cfg.vignetting, cfg.isp_luts ? " -DISP_LUTS" : "",
+           ae_x, ae_y, ae_w, ae_h, AE_X_SKIP, AE_Y_SKIP, cfg.gpu_stats ? " -DAE_STATS" : "");
+  cl_program prg = cl_cached_program_from_file(context, device_id, "cameras/process_raw.cl", args);
+  cl_kernel krnl = CL_CHECK_ERR(clCreateKernel(prg, cfg.gpu_stats ? "process_raw_stats" : "process_raw", &err));
+  cl_kernel krnl_isp_lut = NULL;
+  cl_command_queue q = CL_CHECK_ERR(clCreateCommandQueue(context, device_id, 0, &err));
+  const size_t global_size[] = {(size_t)rgb_width / 2, (size_t)rgb_height / 2};
+  const size_t lut_size = ISP_LUT_SIZE_MAX;
+
+  // the last work items read a little past the frame
+  cl_mem in_cl = CL_CHECK_ERR(clCreateBuffer(context, CL_MEM_READ_ONLY, frame_size + 2 * sensor.frame_stride, NULL, &err));
+  CL_CHECK(clSetKernelArg(krnl, 0, sizeof(cl_mem), &in_cl));
+
+  // process_raw_stats takes the histogram as third argument, the rest move up by one
+  const int expo_arg = cfg.gpu_stats ? 3 : 2;
+  cl_mem ae_stats_cl = NULL;
+  if (cfg.gpu_stats) {
+    ae_stats_cl = CL_CHECK_ERR(clCreateBuffer(context, CL_MEM_READ_WRITE, AE_STATS_BINS * sizeof(uint32_t), NULL, &err));
+    CL_CHECK(clSetKernelArg(krnl, 2, sizeof(cl_mem), &ae_stats_cl));
+  }
+
+  cl_mem vignetting_cl = NULL, isp_lut_cl = NULL;
+  if (cfg.isp_luts) {
+    vignetting_cl = CL_CHECK_ERR(clCreateBuffer(context, CL_MEM_READ_WRITE, global_size[0] * global_size[1] * sizeof(float), NULL, &err));
+    isp_lut_cl = CL_CHECK_ERR(clCreateBuffer(context, CL_MEM_READ_WRITE, ISP_LUT_SIZE_MAX * sizeof(float), NULL, &err));
+    cl_kernel krnl_vignetting = CL_CHECK_ERR(clCreateKernel(prg, "bake_vignetting", &err));
+    CL_CHECK(clSetKernelArg(krnl_vignetting, 0, sizeof(cl_mem), &vignetting_cl));
+    CL_CHECK(clEnqueueNDRangeKernel(q, krnl_vignetting, 2, NULL, global_size, NULL, 0, NULL, NULL));
+    CL_CHECK(clFinish(q));
+    CL_CHECK(clReleaseKernel(krnl_vignetting));
+
+    krnl_isp_lut = CL_CHECK_ERR(clCreateKernel(prg, "bake_isp_lut", &err));
+    CL_CHECK(clSetKernelArg(krnl_isp_lut, 0, sizeof(cl_mem), &isp_lut_cl));
+    CL_CHECK(clSetKernelArg(krnl, expo_arg + 1, sizeof(cl_mem), &vignetting_cl));
+    CL_CHECK(clSetKernelArg(krnl, expo_arg + 2, sizeof(cl_mem), &isp_lut_cl));
+  }
+  CL_CHECK(clReleaseProgram(prg));
+
+  AutoExposure ae(&sensor);
+  uint32_t lum_binning[AE_STATS_BINS];
+  const uint32_t zero = 0;
+  int baked_expo_time = -1;
+
+  printf("%s %dx%d, %d frames in %s, replaying %d%s%s%s\n", cfg.sensor.c_str(), rgb_width, rgb_height, dump_frames, cfg.path.c_str(), frames,
+         cfg.vignetting ? ", vignetting" : "", cfg.isp_luts ? ", isp luts" : "", cfg.gpu_stats ? ", gpu stats" : "");
+
+  StageTimes times;
+  const auto frame_period = std::chrono::duration<double>(cfg.fps > 0 ? 1.0 / cfg.fps : 0.0);
+  auto next_frame = std::chrono::steady_clock::now();
+  for (int i = 0; i < frames; i++) {
+    const uint8_t *raw = &dump[(i % dump_frames) * frame_size];
+    VisionBuf *buf = vipc_server.get_buffer(VISION_STREAM_ROAD);
+    const uint64_t timestamp_sof = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    {
+      StageTimer total(times, TOTAL);
+      {
+        StageTimer t(times, UPLOAD);
+        CL_CHECK(clEnqueueWriteBuffer(q, in_cl, CL_TRUE, 0, frame_size, raw, 0, NULL, NULL));
+      }
+      if (cfg.isp_luts && ae.exposure_time != baked_expo_time) {
+        StageTimer t(times, LUTS);
+        CL_CHECK(clSetKernelArg(krnl_isp_lut, 1, sizeof(int), &ae.exposure_time));
+        CL_CHECK(clEnqueueNDRangeKernel(q, krnl_isp_lut, 1, NULL, &lut_size, NULL, 0, NULL, NULL));
+        CL_CHECK(clFinish(q));
+        baked_expo_time = ae.exposure_time;
+      }
+      {
+        StageTimer t(times, PROCESS_RAW);
+        CL_CHECK(clSetKernelArg(krnl, 1, sizeof(cl_mem), &buf->buf_cl));
+        CL_CHECK(clSetKernelArg(krnl, expo_arg, sizeof(int), &ae.exposure_time));
+        if (cfg.gpu_stats) {
+          CL_CHECK(clEnqueueFillBuffer(q, ae_stats_cl, &zero, sizeof(zero), 0, AE_STATS_BINS * sizeof(uint32_t), 0, NULL, NULL));
+        }
+        CL_CHECK(clEnqueueNDRangeKernel(q, krnl, 2, NULL, global_size, NULL, 0, NULL, NULL));
+        CL_CHECK(clFinish(q));
+      }
+      float grey_frac;
+      {
+        StageTimer t(times, STATS);
+        if (cfg.gpu_stats) {
+          CL_CHECK(clEnqueueReadBuffer(q, ae_stats_cl, CL_TRUE, 0, sizeof(lum_binning), lum_binning, 0, NULL, NULL));
+        } else {
+          grey_histogram((const uint8_t *)buf->addr, yuv_stride, ae_x, ae_y, ae_w, ae_h, lum_binning);
+        }
+        grey_frac = grey_fraction(lum_binning);
+      }
+      {
+        StageTimer t(times, AE);
+        ae.update(grey_frac, i);
+      }
+      {
+        StageTimer t(times, SEND);
+        const uint64_t timestamp_eof = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        VisionIpcBufExtra extra = {(uint32_t)i, timestamp_sof, timestamp_eof, true};
+        vipc_server.send(buf, &extra);
+      }
+    }
+
+    if (cfg.fps > 0) {
+      next_frame += std::chrono::duration_cast<std::chrono::steady_clock::duration>(frame_period);
+      std::this_thread::sleep_until(next_frame);
+    }
+  }
+
+  printf("last exposure: time %d, gain idx %d, dc gain %s\n", ae.exposure_time, ae.gain_idx, ae.dc_gain_enabled ? "on" : "off");
+  printf("%-12s%10s%10s%8s\n", "stage", "mean ms", "max ms", "runs");
+  for (int s = 0; s < STAGE_COUNT; s++) {
+    if (times.count[s] == 0) continue;
+    printf("%-12s%10.3f%10.3f%8d\n", stage_names[s], times.sum[s] / times.count[s], times.max[s], times.count[s]);
+  }
+
+  CL_CHECK(clReleaseCommandQueue(q));
+  CL_CHECK(clReleaseMemObject(in_cl));
+  if (cfg.gpu_stats) {
+    CL_CHECK(clReleaseMemObject(ae_stats_cl));
+  }
+  if (cfg.isp_luts) {
+    CL_CHECK(clReleaseMemObject(isp_lut_cl));
+    CL_CHECK(clReleaseMemObject(vignetting_cl));
+    CL_CHECK(clReleaseKernel(krnl_isp_lut));
+  }
+  CL_CHECK(clReleaseKernel(krnl));
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  ReplayConfig cfg;
+  bool usage = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:n:r:vlgh")) != -1) {
+    switch (opt) {
+      case 's': cfg.sensor = optarg; break;
+      case 'n': cfg.frames = std::max(0, atoi(optarg)); break;
+      case 'r': cfg.fps = std::max(0.0, atof(optarg)); break;
+      case 'v': cfg.vignetting = true; break;
+      case 'l': cfg.isp_luts = true; break;
+      case 'g': cfg.gpu_stats = true; break;
+      default: usage = true; break;
+    }
+  }
+  std::unique_ptr<SensorInfo> sensor = make_sensor(cfg.sensor);
+  if (usage || !sensor || optind != argc - 1) {
+    fprintf(stderr, "usage: %s -s ar0231|ox03c10|os04c10 [-n frames] [-r fps] [-v] [-l] [-g] dump.raw\n", argv[0]);
+    return 1;
+  }
+  cfg.path = argv[optind];
+
+  cl_device_id device_id = cl_get_device_id(CL_DEVICE_TYPE_DEFAULT);
+  cl_context context = cl_create_context(device_id);
+  int ret = replay(device_id, context, *sensor, cfg);
+  CL_CHECK(clReleaseContext(context));
+  return ret;
+}